@@ -7,6 +7,8 @@ QT += widgets
 macx:QT_CONFIG -= no-pkg-config
 
 CONFIG      += plugin
+# The packet packer unrolls its blocks with if constexpr
+CONFIG      += c++17
 INCLUDEPATH += ../../interfaces
 DEPENDPATH  += ../../interfaces
 
@@ -34,10 +36,15 @@ win32 {
 
 HEADERS += ../../interfaces/qlcioplugin.h
 HEADERS += suididevice.h \
+           suidischeduler.h \
+           suiditriplebuffer.h \
+           suidiframequeue.h \
+           suidipacket.h \
            suidi.h
 
 SOURCES += ../../interfaces/qlcioplugin.cpp
 SOURCES += suididevice.cpp \
+           suidischeduler.cpp \
            suidi.cpp
 
 # This must be after "TARGET = " and before target installation so that
@@ -4,11 +4,22 @@
 #include <QString>
 #include <QDebug>
 
+#include "suidischeduler.h"
 #include "suididevice.h"
 #include "suidi.h"
 
+/* Output parameters changing a device while it is streaming */
+#define PARAMETER_FREQUENCY "frequency"
+#define PARAMETER_RATE_DIVIDER "divider"
+#define PARAMETER_KEEPALIVE "keepalive"
+
 SUIDI::~SUIDI()
 {
+    /* Devices hand their transfers back to the scheduler when closed */
+    while (m_devices.isEmpty() == false)
+        delete m_devices.takeFirst();
+
+    delete m_scheduler;
 }
 
 void SUIDI::init()
@@ -18,6 +29,8 @@ void SUIDI::init()
     if (libusb_init(&m_ctx) != 0)
         qWarning() << "Unable to initialize libusb context!";
 
+    m_scheduler = new SUIDIScheduler(m_ctx, this);
+
     rescanDevices();
 }
 
@@ -111,6 +124,18 @@ QString SUIDI::outputInfo(quint32 output)
     if (output != QLCIOPlugin::invalidLine() && output < quint32(m_devices.size()))
     {
         str += m_devices.at(output)->infoText();
+        str += QString("<P><B>%1:</B> %2").arg(tr("Frame Clock Scheduling"))
+                                         .arg(m_scheduler->realtimeMode());
+        str += QString("<BR>");
+        str += QString("<B>%1:</B> %2/s").arg(tr("Frame Clock Wakeups"))
+                                         .arg(m_scheduler->wakeupRate());
+        str += QString("<BR>");
+        str += QString("<B>%1:</B> &plusmn;%2ms").arg(tr("Frame Grouping Window"))
+                                         .arg(m_scheduler->groupingWindow() / 1000.0, 0, 'f', 3);
+        str += QString("<BR>");
+        str += QString("<B>%1:</B> %2 %3ms, %4 %5ms</P>").arg(tr("Frame Skew Between Devices"))
+                .arg(tr("last")).arg(m_scheduler->lastSkew() / 1000.0, 0, 'f', 3)
+                .arg(tr("max")).arg(m_scheduler->maxSkew() / 1000.0, 0, 'f', 3);
     }
 
     str += QString("</BODY>");
@@ -122,10 +147,27 @@ QString SUIDI::outputInfo(quint32 output)
 void SUIDI::writeUniverse(quint32 universe, quint32 output, const QByteArray &data, bool dataChanged)
 {
     Q_UNUSED(universe)
-    Q_UNUSED(dataChanged)
     if (output < quint32(m_deviceOutputs.size()))
         m_deviceOutputs.at(output)->device->
-                outputDMX(m_deviceOutputs.at(output)->outputUniverse, data);
+                outputDMX(m_deviceOutputs.at(output)->outputUniverse, data, dataChanged);
+}
+
+void SUIDI::setParameter(quint32 universe, quint32 line, Capability type,
+                         QString name, QVariant value)
+{
+    QLCIOPlugin::setParameter(universe, line, type, name, value);
+
+    if (type != Output || line >= quint32(m_deviceOutputs.size()))
+        return;
+
+    /* Applied at once, the device remembers them for the next open */
+    DeviceOutputs *output = m_deviceOutputs.at(line);
+    if (name == PARAMETER_FREQUENCY)
+        output->device->setFrequency(value.toDouble());
+    else if (name == PARAMETER_RATE_DIVIDER)
+        output->device->setRateDivider(output->outputUniverse, value.toInt());
+    else if (name == PARAMETER_KEEPALIVE)
+        output->device->setKeepalive(value.toInt());
 }
 
 void SUIDI::rescanDevices()
@@ -133,7 +175,7 @@ void SUIDI::rescanDevices()
     /* Treat all devices as dead first, until we find them again. Those
        that aren't found, get destroyed at the end of this function. */
     QList <SUIDIDevice*> destroyList(m_devices);
-    int devCount = m_devices.count();
+    bool changed = false;
 
     libusb_device** devices = NULL;
     ssize_t count = libusb_get_device_list(m_ctx, &devices);
@@ -161,8 +203,9 @@ void SUIDI::rescanDevices()
         else if (SUIDIDevice::isSUIDIDevice(&desc) == true)
         {
             /* This is a new device. Create and append. */
-            udev = new SUIDIDevice(dev, &desc, this);
+            udev = new SUIDIDevice(m_scheduler, dev, &desc, this);
             m_devices.append(udev);
+            changed = true;
         }
     }
 
@@ -172,9 +215,11 @@ void SUIDI::rescanDevices()
         SUIDIDevice* udev = destroyList.takeFirst();
         m_devices.removeAll(udev);
         delete udev;
+        changed = true;
     }
 
-    if (m_devices.count() != devCount)
+    /* A device that re-enumerated is replaced without changing the count */
+    if (changed == true)
         emit configurationChanged();
 }
 
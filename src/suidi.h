@@ -7,6 +7,7 @@
 #include "qlcioplugin.h"
 
 struct libusb_device;
+class SUIDIScheduler;
 class SUIDIDevice;
 
 typedef struct {
@@ -60,6 +61,10 @@ public:
     /** @reimp */
     void writeUniverse(quint32 universe, quint32 output, const QByteArray& data, bool dataChanged);
 
+    /** @reimp */
+    void setParameter(quint32 universe, quint32 line, Capability type,
+                      QString name, QVariant value);
+
 private:
     /** Attempt to find all SUIDI devices */
     void rescanDevices();
@@ -70,6 +75,9 @@ private:
 private:
     struct libusb_context* m_ctx;
 
+    /** Frame clock shared by all devices */
+    SUIDIScheduler* m_scheduler;
+
     /** List of available devices */
     QList <SUIDIDevice*> m_devices;
     QList <DeviceOutputs*> m_deviceOutputs;
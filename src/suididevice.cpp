@@ -3,14 +3,21 @@
 
 #include <QElapsedTimer>
 #include <QSettings>
+#include <QThread>
 #include <QDebug>
+#include <QHash>
+#include <cstring>
+#include <chrono>
 #include <cmath>
 
+#include "suidischeduler.h"
 #include "suididevice.h"
 #include "qlcmacros.h"
 
 #define DMX_CHANNELS 512
 
+static_assert(suidiPacketLength() == SUIDI_PACKET_SIZE, "SUIDI packet layout out of sync");
+
 #define SUIDI_SHARED_VENDOR         0x6244
 #define SUIDI_SHARED_PRODUCT_00     0x0301
 #define SUIDI_SHARED_PRODUCT_01     0x0302
@@ -46,53 +53,243 @@
 
 #define SUIDI_SET_CHANNEL_RANGE 0x0002 /* Command to set n channel values */
 
+#define SUIDI_COMMIT_REQUEST_TYPE 0xc0
+#define SUIDI_COMMIT_REQUEST 0x08 /* Latch the transferred universes */
+#define SUIDI_COMMIT_TIMEOUT 10
+#define SUIDI_PROBE_TIMEOUT 100
+#define SUIDI_DEFAULT_MAX_PACKET_SIZE 64
+#define SUIDI_INTERFACE 0
+#define SUIDI_QUEUE_POLL 250 /* us between checks of a full queue */
+
 #define SETTINGS_FREQUENCY "suidi/frequency"
+#define SETTINGS_RATE_DIVIDER "suidi/divider"
+#define SETTINGS_KEEPALIVE "suidi/keepalive"
+#define SETTINGS_ADAPTIVE "suidi/adaptive"
+#define SETTINGS_MIN_FREQUENCY "suidi/minfrequency"
+#define SETTINGS_MAX_FREQUENCY "suidi/maxfrequency"
+#define SETTINGS_BATCHED "suidi/batched"
+#define SETTINGS_ZERO_PACKET "suidi/zeropacket"
+#define SETTINGS_DELIVERY "suidi/delivery"
+#define SETTINGS_SHORT_UNIVERSE "suidi/shortuniverse"
+
+/****************************************************************************
+ * Transfer completion
+ ****************************************************************************/
+
+static qint64 monotonicUsecs()
+{
+    return std::chrono::duration_cast<std::chrono::microseconds>(
+                std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+/* Commit probe results, shared by all devices of the same product */
+static QHash <quint16, bool> s_commitRequired;
+
+/* Products whose firmware failed batched universes, recorded by the
+   frame clock and looked up when opening */
+static QHash <quint16, bool> s_batchRejected;
+static QMutex s_batchRejectedMutex;
+
+static void completeFrameTransfer(CommitTransfer *ct)
+{
+    if (ct == NULL || ct->pending.deref() == true)
+        return;
+
+    /* Last bulk transfer of the frame is done, latch it */
+    int r = libusb_submit_transfer(ct->transfer);
+    if (r < 0)
+    {
+        qWarning() << "SUIDI: unable to commit universes:" << libusb_strerror(libusb_error(r));
+        ct->busy.storeRelease(0);
+    }
+}
+
+/* Bytes per second an interrupt or iso endpoint has reserved on the bus */
+static int reservedBandwidth(const struct libusb_endpoint_descriptor *desc, int speed)
+{
+    int type = desc->bmAttributes & LIBUSB_TRANSFER_TYPE_MASK;
+    if (type != LIBUSB_TRANSFER_TYPE_INTERRUPT && type != LIBUSB_TRANSFER_TYPE_ISOCHRONOUS)
+        return 0;
+
+    int interval = qMax(1, int(desc->bInterval));
+    qint64 bytes = (desc->wMaxPacketSize & 0x07ff) * (((desc->wMaxPacketSize >> 11) & 0x03) + 1);
+    qint64 period;
+
+    /* High speed counts 125us microframes, full speed 1ms frames and
+       only iso uses an exponent there */
+    if (speed >= LIBUSB_SPEED_HIGH)
+        period = 125 << qMin(interval - 1, 15);
+    else if (type == LIBUSB_TRANSFER_TYPE_ISOCHRONOUS)
+        period = 1000 << qMin(interval - 1, 15);
+    else
+        period = 1000 * interval;
+
+    return static_cast<int>(bytes * 1000000 / period);
+}
+
+/* Bytes of the packet accepted by the device so far */
+static int writtenLength(EndpointTransfer *et, struct libusb_transfer *transfer)
+{
+    if (transfer->type != LIBUSB_TRANSFER_TYPE_ISOCHRONOUS)
+    {
+        et->written += transfer->actual_length;
+        return et->written;
+    }
+
+    int written = 0;
+    for (int i = 0; i < transfer->num_iso_packets; i++)
+        if (transfer->iso_packet_desc[i].status == LIBUSB_TRANSFER_COMPLETED)
+            written += transfer->iso_packet_desc[i].actual_length;
+    return written;
+}
+
+/* A transfer of a whole number of packets has no short packet to end
+   it, firmware waiting for one gets a zero-length packet after it */
+static void setZeroPacket(UniverseEndpoint *ep, struct libusb_transfer *transfer)
+{
+    if (ep->zeroPacket == true && transfer->length % ep->maxPacketSize == 0 &&
+        ep->transferType != LIBUSB_TRANSFER_TYPE_ISOCHRONOUS)
+        transfer->flags |= LIBUSB_TRANSFER_ADD_ZERO_PACKET;
+    else
+        transfer->flags &= ~LIBUSB_TRANSFER_ADD_ZERO_PACKET;
+}
+
+/* Queue the rest of a partially accepted packet, as long as the frame
+   it belongs to has not run out of time */
+static bool resubmitShortWrite(UniverseEndpoint *ep, EndpointTransfer *et)
+{
+    if (et->retries >= SUIDI_SHORT_WRITE_RETRIES || monotonicUsecs() >= et->deadline)
+        return false;
+
+    et->retries++;
+    et->transfer->buffer = et->packet + et->written;
+    et->transfer->length = et->length - et->written;
+    setZeroPacket(ep, et->transfer);
+
+    return libusb_submit_transfer(et->transfer) == 0;
+}
+
+static void LIBUSB_CALL transferCallback(struct libusb_transfer *transfer)
+{
+    UniverseEndpoint *ep = static_cast<UniverseEndpoint*>(transfer->user_data);
+
+    EndpointTransfer *et = &ep->transfers[0];
+    for (int t = 1; t < SUIDI_FRAMES_IN_FLIGHT; t++)
+        if (ep->transfers[t].transfer == transfer)
+            et = &ep->transfers[t];
+
+    switch (transfer->status)
+    {
+        case LIBUSB_TRANSFER_COMPLETED:
+        {
+            int written = writtenLength(et, transfer);
+            ep->lastLength.storeRelaxed(written);
+            if (written < et->length)
+            {
+                ep->shortWrites.ref();
+
+                /* Iso data is never retried */
+                if (transfer->type != LIBUSB_TRANSFER_TYPE_ISOCHRONOUS &&
+                    resubmitShortWrite(ep, et) == true)
+                    return;
+
+                /* Still incomplete, counts like a timed out transfer */
+                ep->failures.ref();
+                ep->resend.storeRelease(1);
+                qWarning() << "SUIDI: short write of" << written << "bytes on endpoint" << ep->endpoint;
+                break;
+            }
+
+            int latency = static_cast<int>(monotonicUsecs() - et->submitted);
+            ep->lastLatency.storeRelaxed(latency);
+            if (latency > ep->maxLatency.loadRelaxed())
+                ep->maxLatency.storeRelaxed(latency);
+            ep->failures.storeRelaxed(0);
+            ep->recovery.storeRelaxed(0);
+        }
+        break;
+        case LIBUSB_TRANSFER_TIMED_OUT:
+        case LIBUSB_TRANSFER_STALL:
+        case LIBUSB_TRANSFER_ERROR:
+            ep->failures.ref();
+            ep->resend.storeRelease(1);
+            qWarning() << "SUIDI: unable to write universe, transfer status:"
+                       << transfer->status;
+        break;
+        default:
+        break;
+    }
+
+    CommitTransfer *ct = et->commit;
+    if (et->sending != NULL)
+        et->sending->deref();
+    et->busy.storeRelease(0);
+    ep->inFlight.deref();
+
+    completeFrameTransfer(ct);
+}
+
+static void LIBUSB_CALL commitCallback(struct libusb_transfer *transfer)
+{
+    CommitTransfer *ct = static_cast<CommitTransfer*>(transfer->user_data);
+
+    if (transfer->status != LIBUSB_TRANSFER_COMPLETED &&
+        transfer->status != LIBUSB_TRANSFER_CANCELLED)
+    {
+        qWarning() << "SUIDI: unable to commit universes, transfer status:"
+                   << transfer->status;
+    }
+
+    ct->busy.storeRelease(0);
+}
 
 /****************************************************************************
  * Initialization
  ****************************************************************************/
 
-SUIDIDevice::SUIDIDevice(struct libusb_device* device, libusb_device_descriptor *desc, QObject* parent)
-    : QThread(parent)
+SUIDIDevice::SUIDIDevice(SUIDIScheduler *scheduler, struct libusb_device* device,
+                         libusb_device_descriptor *desc, QObject* parent)
+    : QObject(parent)
+    , m_scheduler(scheduler)
     , m_device(device)
-    , m_descriptor(desc)
+    , m_productId(desc->idProduct)
     , m_handle(NULL)
-    , m_running(false)
-    , m_frequency(SUIDI_DEFAULT_FREQUENCY)
-    , m_granularity(Unknown)
+    , m_lost(false)
+    , m_commitRequired(true)
+    , m_batch()
+    , m_batched(false)
+    , m_shortPolicy(ShortZeroFill)
+    , m_delivery(DeliverLatest)
+    , m_dmaFrame(NULL)
+    , m_framePeriod(1000000000 / SUIDI_DEFAULT_FREQUENCY)
+    , m_frameCount(0)
+    , m_keepalive(0)
+    , m_adaptive(false)
+    , m_minFrequency(SUIDI_ADAPTIVE_MIN_FREQUENCY)
+    , m_maxFrequency(SUIDI_ADAPTIVE_MAX_FREQUENCY)
+    , m_adaptiveFrames(0)
+    , m_adaptiveLatency(0)
+    , m_adaptiveDropped(0)
 {
     Q_ASSERT(device != NULL);
-    extractNameEndpoints();
+    for (int f = 0; f < SUIDI_FRAMES_IN_FLIGHT; f++)
+        m_commits[f].transfer = NULL;
+    m_frame.storeRelaxed(m_heapFrame);
+    extractNameEndpoints(desc);
+    memset(m_inputs, 0, sizeof(m_inputs));
+    memset(m_inputCount, 0, sizeof(m_inputCount));
+    memset(m_blockStamps, 0, sizeof(m_blockStamps));
+    memset(m_packStamps, 0, sizeof(m_packStamps));
     /* free suidi requsts */
     for(int universeNumber = 0;
-        universeNumber < SUIDI_MAX_UNIVERSES;
+        universeNumber < SUIDI_FRAME_SIZE / SUIDI_PACKET_SIZE;
         universeNumber++)
-    {
-        int i = 0,z = 0;
-        for(int x = 0;x < 9;x++){
-            m_universe[universeNumber][z] = uchar(x);
-            z++;
-            for(int y = 0;y < 57;y++, i++){
-                if(i < 512){
-                    m_universe[universeNumber][z] = 0x00;
-                    z++;
-                }
-            }
-            m_universe[universeNumber][z] = uchar(0x00);
-            z++;
-            m_universe[universeNumber][z] = uchar(0x00);
-            z++;
-            m_universe[universeNumber][z] = uchar(0x00);
-            z++;
-            m_universe[universeNumber][z] = uchar(0x00);
-            z++;
-            m_universe[universeNumber][z] = uchar(0x00);
-            z++;
-            m_universe[universeNumber][z] = uchar(0x00);
-            z++;
-        }
-        m_universe[universeNumber][SUIDI_PACKET_SIZE - 1] = uchar(0xFF);
-    }
+        suidiPacketHeader(m_heapFrame + universeNumber * SUIDI_PACKET_SIZE);
+
+    uchar packet[SUIDI_PACKET_SIZE];
+    suidiPacketHeader(packet);
+    for (int u = 0; u < SUIDI_MAX_UNIVERSES; u++)
+        m_queues[u].fill(packet);
 }
 
 SUIDIDevice::~SUIDIDevice()
@@ -152,10 +349,17 @@ bool SUIDIDevice::isSUIDIDevice(const struct libusb_device_descriptor* desc)
     return isSUIDI;
 }
 
-void SUIDIDevice::extractNameEndpoints()
+void SUIDIDevice::extractNameEndpoints(const libusb_device_descriptor *desc)
 {
     Q_ASSERT(m_device != NULL);
 
+    /* The port path stays the same across replugs, unlike the address */
+    uint8_t ports[7];
+    int depth = libusb_get_port_numbers(m_device, ports, sizeof(ports));
+    m_location = QString::number(libusb_get_bus_number(m_device));
+    for (int i = 0; i < depth; i++)
+        m_location += QString(i == 0 ? "-%1" : ".%1").arg(ports[i]);
+
     libusb_device_handle* handle = NULL;
     int r = libusb_open(m_device, &handle);
     if (r == 0)
@@ -164,7 +368,7 @@ void SUIDIDevice::extractNameEndpoints()
         int len = 0;
 
         /* Extract the name */
-        len = libusb_get_string_descriptor_ascii(handle, m_descriptor->iProduct,
+        len = libusb_get_string_descriptor_ascii(handle, desc->iProduct,
                                                  (uchar*) &buf, sizeof(buf));
         if (len > 0)
         {
@@ -186,18 +390,31 @@ void SUIDIDevice::extractNameEndpoints()
             for(int i = 0;i < endp;i++){
                 uint8_t bEndpointAddress = m_config->interface[0].altsetting[0].endpoint[i].bEndpointAddress;
                 uint8_t bDescriptorType = m_config->interface[0].altsetting[0].endpoint[i].bDescriptorType;
-                if(bDescriptorType == LIBUSB_DT_ENDPOINT && bEndpointAddress < 0x80)
-                    endpoints.append(new UniverseEndpoint{
-                                         bEndpointAddress, false
-                                     });
-                uint16_t wMaxPacketSize = m_config->interface[0].altsetting[0].endpoint[i].wMaxPacketSize;
-                if(len > static_cast<int>(wMaxPacketSize))
-                    len = static_cast<int>(wMaxPacketSize);
+                /* Bits 11..12 only encode extra high-bandwidth transactions */
+                uint16_t wMaxPacketSize = m_config->interface[0].altsetting[0].endpoint[i].wMaxPacketSize & 0x07ff;
+                if(bDescriptorType == LIBUSB_DT_ENDPOINT && bEndpointAddress < 0x80){
+                    UniverseEndpoint *ep = new UniverseEndpoint();
+                    ep->endpoint = bEndpointAddress;
+                    ep->rateDivider.storeRelaxed(1);
+                    ep->maxPacketSize = wMaxPacketSize > 0 ? wMaxPacketSize : SUIDI_DEFAULT_MAX_PACKET_SIZE;
+                    ep->transferType = m_config->interface[0].altsetting[0].endpoint[i].bmAttributes
+                                       & LIBUSB_TRANSFER_TYPE_MASK;
+                    if (ep->transferType == LIBUSB_TRANSFER_TYPE_ISOCHRONOUS)
+                        ep->isoPackets = (SUIDI_PACKET_SIZE + ep->maxPacketSize - 1) / ep->maxPacketSize;
+                    ep->reservedBandwidth = reservedBandwidth(&m_config->interface[0].altsetting[0].endpoint[i],
+                                                              libusb_get_device_speed(m_device));
+                    endpoints.append(ep);
+                }
             }
         }
         else
         {
-            endpoints.append(new UniverseEndpoint{ 0x02, false });
+            UniverseEndpoint *ep = new UniverseEndpoint();
+            ep->endpoint = 0x02;
+            ep->rateDivider.storeRelaxed(1);
+            ep->maxPacketSize = SUIDI_DEFAULT_MAX_PACKET_SIZE;
+            ep->transferType = LIBUSB_TRANSFER_TYPE_BULK;
+            endpoints.append(ep);
         }
     }
     libusb_close(handle);
@@ -220,20 +437,92 @@ QString SUIDIDevice::infoText() const
         info += QString("<BR>");
         info += QString("<B>%1:</B> %2").arg(tr("DMX Channels")).arg(512);
         info += QString("<BR>");
-        info += QString("<B>%1:</B> %2Hz").arg(tr("DMX Frame Frequency")).arg(m_frequency);
+        info += QString("<B>%1:</B> %2Hz").arg(tr("DMX Frame Frequency")).arg(frequency(), 0, 'f', 1);
+        if (m_adaptive == true)
+            info += QString(" (%1 %2-%3Hz)").arg(tr("adaptive"))
+                    .arg(m_minFrequency, 0, 'f', 1).arg(m_maxFrequency, 0, 'f', 1);
         info += QString("<BR>");
-        if (m_granularity == Bad)
-            gran = QString("<FONT COLOR=\"#aa0000\">%1</FONT>").arg(tr("Bad"));
-        else if (m_granularity == Good)
-            gran = QString("<FONT COLOR=\"#00aa00\">%1</FONT>").arg(tr("Good"));
-        else
+        if (m_scheduler->isCalibrated() == false)
             gran = tr("Patch this device to a universe to find out.");
+        else
+            gran = QString("%1 %2ms, %3 %4ms, %5 %6ms")
+                   .arg(tr("sleep overshoot")).arg(m_scheduler->meanOvershoot() / 1000.0, 0, 'f', 3)
+                   .arg(tr("max")).arg(m_scheduler->maxOvershoot() / 1000.0, 0, 'f', 3)
+                   .arg(tr("spinning")).arg(m_scheduler->spinMargin() / 1000.0, 0, 'f', 3);
         info += QString("<B>%1:</B> %2").arg(tr("System Timer Accuracy")).arg(gran);
+        info += QString("<BR>");
+        info += QString("<B>%1:</B> %2").arg(tr("Skipped Frame Deadlines"))
+                .arg(m_scheduler->skippedFrames(this));
+        info += QString("<BR>");
+        info += QString("<B>%1:</B> %2").arg(tr("Frame Commit"))
+                .arg(m_commitRequired ? tr("Required") : tr("Not required"));
+        info += QString("<BR>");
+        info += QString("<B>%1:</B> %2").arg(tr("Universe Transfers"))
+                .arg(m_batched ? tr("Batched in one transfer") : tr("One transfer per universe"));
+        info += QString("<BR>");
+        if (m_delivery == DeliverQueuedDropOldest)
+            gran = tr("Every frame in order, dropping the oldest when full");
+        else if (m_delivery == DeliverQueuedLockStep)
+            gran = tr("Every frame in order, in lock-step with QLC+");
+        else
+            gran = tr("Latest frame");
+        info += QString("<B>%1:</B> %2").arg(tr("Frame Delivery")).arg(gran);
+        info += QString("<BR>");
+        info += QString("<B>%1:</B> %2").arg(tr("Short Universes"))
+                .arg(m_shortPolicy == ShortKeepLast ? tr("Missing channels keep their value")
+                                                    : tr("Missing channels go to zero"));
+        info += QString("<BR>");
+        if (sendsOnChange() == true)
+            gran = tr("On change, unchanged universes every %1ms").arg(keepalive());
+        else
+            gran = tr("Every frame");
+        info += QString("<B>%1:</B> %2").arg(tr("Universe Refresh")).arg(gran);
+        for (qsizetype i = 0; i < endpoints.count(); i++)
+        {
+            const UniverseEndpoint *ep = endpoints.at(i);
+            info += QString("<BR>");
+            info += QString("<B>%1 %2:</B> %3Hz, ")
+                    .arg(tr("Universe")).arg(int(i + 1))
+                    .arg(frequency() / ep->rateDivider.loadRelaxed(), 0, 'f', 1);
+            info += QString("%3 %4ms, %5 %6ms, %7 %8")
+                    .arg(tr("latency")).arg(ep->lastLatency.loadRelaxed() / 1000.0, 0, 'f', 1)
+                    .arg(tr("max")).arg(ep->maxLatency.loadRelaxed() / 1000.0, 0, 'f', 1)
+                    .arg(tr("dropped frames")).arg(ep->dropped.loadRelaxed());
+            if (ep->transferType == LIBUSB_TRANSFER_TYPE_INTERRUPT)
+                info += QString(", %1").arg(tr("interrupt"));
+            else if (ep->transferType == LIBUSB_TRANSFER_TYPE_ISOCHRONOUS)
+                info += QString(", %1").arg(tr("isochronous"));
+            else
+                info += QString(", %1").arg(tr("bulk"));
+            if (ep->reservedBandwidth > 0)
+                info += QString(" %1 %2 kB/s").arg(tr("reserving"))
+                        .arg(ep->reservedBandwidth / 1000.0, 0, 'f', 1);
+            info += QString(", %1 %2/%3 (%4 x %5), %6 %7")
+                    .arg(tr("written")).arg(ep->lastLength.loadRelaxed()).arg(SUIDI_PACKET_SIZE)
+                    .arg((SUIDI_PACKET_SIZE + ep->maxPacketSize - 1) / ep->maxPacketSize)
+                    .arg(ep->maxPacketSize)
+                    .arg(tr("short writes")).arg(ep->shortWrites.loadRelaxed());
+            if (ep->zeroPacket == true && SUIDI_PACKET_SIZE % ep->maxPacketSize == 0)
+                info += QString(", %1").arg(tr("ended by a zero-length packet"));
+            if (m_delivery != DeliverLatest)
+                info += QString(", %1 %2/%3, %4 %5")
+                        .arg(tr("queued")).arg(m_queues[i].count()).arg(SUIDI_QUEUE_FRAMES)
+                        .arg(tr("overflowed")).arg(ep->queueDrops.loadRelaxed());
+            info += QString(", %1 %2, %3 %4")
+                    .arg(tr("unchanged inputs")).arg(ep->unchangedInputs.loadRelaxed())
+                    .arg(tr("frames skipped")).arg(ep->unchangedFrames.loadRelaxed());
+            info += QString(", %1 %2/%3")
+                    .arg(tr("blocks reused/copied"))
+                    .arg(ep->blockHits.loadRelaxed()).arg(ep->blockMisses.loadRelaxed());
+        }
         info += QString("</P>");
     }
     else
     {
-        info += QString("<P><B>%1</B></P>").arg(tr("Device not in use"));
+        if (m_lost == true)
+            info += QString("<P><B>%1</B></P>").arg(tr("Device re-enumerated after a reset, re-scan the hardware to use it again"));
+        else
+            info += QString("<P><B>%1</B></P>").arg(tr("Device not in use"));
     }
 
     return info;
@@ -257,11 +546,11 @@ bool SUIDIDevice::open(quint32 universe)
 
     if (m_device != NULL && m_handle == NULL)
     {
-        qDebug() << "Open SUIDI with idProduct:" << m_descriptor->idProduct;
+        qDebug() << "Open SUIDI with idProduct:" << m_productId;
         int ret = libusb_open(m_device, &m_handle);
         if (ret < 0)
         {
-            qWarning() << "Unable to open SUIDI with idProduct:" << m_descriptor->idProduct;
+            qWarning() << "Unable to open SUIDI with idProduct:" << m_productId;
             m_handle = NULL;
         }
 
@@ -372,7 +661,32 @@ bool SUIDIDevice::open(quint32 universe)
     if (m_handle == NULL)
         return false;
 
-    start();
+    int delivery = QSettings().value(QString("%1/%2").arg(SETTINGS_DELIVERY).arg(m_location),
+                                     int(DeliverLatest)).toInt();
+    if (delivery < DeliverLatest || delivery > DeliverQueuedLockStep)
+        delivery = DeliverLatest;
+    m_delivery = DeliveryMode(delivery);
+
+    m_shortPolicy = QSettings().value(QString("%1/%2").arg(SETTINGS_SHORT_UNIVERSE).arg(m_location),
+                                      int(ShortZeroFill)).toInt() == ShortKeepLast ?
+                    ShortKeepLast : ShortZeroFill;
+
+    loadRates();
+
+    if (allocateTransfers() == false)
+    {
+        qWarning() << "Unable to allocate SUIDI transfers";
+        freeTransfers();
+        libusb_close(m_handle);
+        m_handle = NULL;
+        return false;
+    }
+
+    m_commitRequired = probeCommit();
+
+    m_lost = false;
+    m_frameCount = 0;
+    m_scheduler->addDevice(this);
 
     return true;
 }
@@ -389,7 +703,13 @@ void SUIDIDevice::close(quint32 universe)
     if(opened)
         return;
 
-    stop();
+    m_scheduler->removeDevice(this);
+    freeTransfers();
+
+    /* Hand the last captured inputs back to QLC+ */
+    for (int u = 0; u < SUIDI_MAX_UNIVERSES; u++)
+        for (int slot = 0; slot < SUIDI_CAPTURE_SLOTS; slot++)
+            m_captures[u][slot] = QByteArray();
 
     if (m_device != NULL && m_handle != NULL)
         libusb_close(m_handle);
@@ -403,101 +723,895 @@ const struct libusb_device* SUIDIDevice::device() const
 }
 
 /****************************************************************************
- * Thread
+ * Frames
  ****************************************************************************/
 
-void SUIDIDevice::outputDMX(quint32 universeNumber, const QByteArray& universe)
-{
-    /* Create SUIDI request */
-    int i = 0,z = 0;
-    for(int x = 0;x < 9;x++){
-        m_universe[universeNumber][z] = uchar(x);
-        z++;
-        for(int y = 0;y < 57;y++, i++){
-            if(i < 512){
-                m_universe[universeNumber][z] = universe.at(i);
-                z++;
+/* In latest delivery only a reference is kept, the writer packs it */
+void SUIDIDevice::outputDMX(quint32 universeNumber, const QByteArray& universe,
+                            bool dataChanged)
+{
+    UniverseEndpoint *ep = endpoints.at(universeNumber);
+    int u = int(universeNumber);
+
+    /* Unchanged data is packed already, the keepalive sends it again */
+    bool onChange = sendsOnChange();
+    if (onChange == true && dataChanged == false)
+    {
+        ep->unchangedInputs.ref();
+        return;
+    }
+
+    if (m_delivery == DeliverLatest)
+    {
+        /* Only keep a reference, the writer compares and packs it */
+        SUIDITripleBuffer<SUIDI_CAPTURE_SLOTS> &capture = m_captureSlots[u];
+        m_captures[u][capture.back()] = universe;
+        capture.publish();
+        ep->captures.ref();
+        if (onChange == true)
+            m_scheduler->wakeUp();
+        return;
+    }
+
+    /* Hosts flagging every universe as changed are double checked
+       against the previous input, unless every frame has to be queued */
+    uint dirty = 0;
+    if (onChange == false || dataChanged == true)
+        dirty = inputChanged(u, universe);
+    if (onChange == true && dirty == 0)
+    {
+        ep->unchangedInputs.ref();
+        return;
+    }
+
+    /* Every frame waits its turn in the queue */
+    reserveQueue(u);
+    packUniverse(u, m_queues[u].back(), SUIDI_UNIVERSE_BUFFERS + m_queues[u].backIndex());
+    m_queues[u].push();
+
+    ep->generation.ref();
+    if (onChange == true)
+        m_scheduler->wakeUp();
+}
+
+void SUIDIDevice::collectUniverse(int universe)
+{
+    UniverseEndpoint *ep = endpoints.at(universe);
+    int captures = ep->captures.loadAcquire();
+    if (captures == ep->collectedCaptures)
+        return;
+    ep->collectedCaptures = captures;
+
+    /* The counter may run ahead of a capture already picked up, and
+       a slot cleared on close may still be flagged fresh. Neither is
+       an input, an empty one would black the universe out. */
+    bool fresh = false;
+    QByteArray &input = m_captures[universe][m_captureSlots[universe].front(&fresh)];
+    if (fresh == false || input.isNull() == true)
+        return;
+
+    /* Drop the reference once compared, so QLC+ can write the next
+       tick in place instead of detaching a copy */
+    uint dirty = inputChanged(universe, input);
+    input = QByteArray();
+    if (dirty == 0)
+    {
+        ep->unchangedInputs.ref();
+        return;
+    }
+
+    /* Create SUIDI request right in a buffer the transfers can send */
+    SUIDITripleBuffer<SUIDI_UNIVERSE_BUFFERS> &buffers = m_buffers[universe];
+    packUniverse(universe, universeBuffer(universe, buffers.back()), buffers.back());
+    buffers.publish();
+
+    ep->generation.ref();
+}
+
+uint SUIDIDevice::inputChanged(int universe, const QByteArray& data)
+{
+    const uchar *channels = reinterpret_cast<const uchar*>(data.constData());
+    int length = qBound(0, int(data.size()), SUIDI_PACKET_CHANNELS);
+
+    /* A short universe is completed in one go, the supplied channels
+       copied and the tail zeroed or carried over by policy, so the
+       block compare never reads past what the host handed over */
+    uchar complete[SUIDI_PACKET_CHANNELS];
+    if (length < SUIDI_PACKET_CHANNELS)
+    {
+        memcpy(complete, channels, length);
+        if (m_shortPolicy == ShortKeepLast)
+            memcpy(complete + length, m_inputs[universe] + length, SUIDI_PACKET_CHANNELS - length);
+        else
+            memset(complete + length, 0, SUIDI_PACKET_CHANNELS - length);
+        channels = complete;
+    }
+
+    uint dirty = suidiDirtyBlocks(m_inputs[universe], channels);
+    if (dirty == 0)
+        return 0;
+
+    memcpy(m_inputs[universe], channels, SUIDI_PACKET_CHANNELS);
+
+    /* Stamp the changed blocks with the input that changed them */
+    quint32 input = ++m_inputCount[universe];
+    for (int block = 0; block < SUIDI_PACKET_BLOCKS; block++)
+        if (dirty & (1u << block))
+            m_blockStamps[universe][block] = input;
+
+    return dirty;
+}
+
+void SUIDIDevice::packUniverse(int universe, uchar *packet, int buffer)
+{
+    /* Only the channels change, the rest of the packet was laid down
+       once. Of those, only blocks newer than the buffer are copied. */
+    quint32 packed = m_packStamps[universe][buffer];
+    uint blocks = 0;
+    for (int block = 0; block < SUIDI_PACKET_BLOCKS; block++)
+        if (m_blockStamps[universe][block] > packed)
+            blocks |= 1u << block;
+
+    suidiPackBlocks(packet, m_inputs[universe], blocks);
+    m_packStamps[universe][buffer] = m_inputCount[universe];
+
+    int copied = qPopulationCount(blocks);
+    endpoints.at(universe)->blockMisses.fetchAndAddRelaxed(copied);
+    endpoints.at(universe)->blockHits.fetchAndAddRelaxed(SUIDI_PACKET_BLOCKS - copied);
+}
+
+void SUIDIDevice::reserveQueue(int universe)
+{
+    SUIDIFrameQueue<SUIDI_QUEUE_FRAMES, SUIDI_PACKET_SIZE> &queue = m_queues[universe];
+
+    /* Hold the caller back until the writer caught up, but never for
+       longer than the transfers already on the bus may take */
+    if (m_delivery == DeliverQueuedLockStep && queue.isFull())
+    {
+        QElapsedTimer timer;
+        timer.start();
+        while (queue.isFull() && timer.elapsed() < frameTime() * SUIDI_FRAMES_IN_FLIGHT)
+            QThread::usleep(SUIDI_QUEUE_POLL);
+    }
+
+    while (queue.isFull())
+    {
+        if (queue.dropOldest() == true)
+            endpoints.at(universe)->queueDrops.ref();
+    }
+}
+
+bool SUIDIDevice::isUniverseDue(int universe, quint32 frame, qint64 now)
+{
+    UniverseEndpoint *ep = endpoints.at(universe);
+    int keepalive = m_keepalive.loadRelaxed();
+    if (keepalive == 0)
+        return frame % quint32(ep->rateDivider.loadRelaxed()) == 0;
+
+    /* New generations, frames still queued and failed sends go out at
+       once, an unchanged universe only keeps the line alive */
+    if (ep->generation.loadAcquire() != ep->queuedGeneration ||
+        (m_delivery != DeliverLatest && m_queues[universe].count() > 0) ||
+        ep->resend.loadAcquire() != 0 ||
+        now - ep->lastSent >= qint64(keepalive) * 1000)
+        return true;
+
+    ep->unchangedFrames.ref();
+    return false;
+}
+
+void SUIDIDevice::markUniverseSent(int universe, int generation, qint64 now)
+{
+    UniverseEndpoint *ep = endpoints.at(universe);
+    ep->queuedGeneration = generation;
+    ep->resend.storeRelaxed(0);
+    ep->lastSent = now;
+}
+
+void SUIDIDevice::dequeueUniverse(int universe, uchar *packet, const uchar *last)
+{
+    if (m_queues[universe].pop(packet) == true)
+        return;
+
+    /* Nothing new, keep the DMX line refreshed with the last frame */
+    if (last != NULL && last != packet)
+        memcpy(packet, last, SUIDI_PACKET_SIZE);
+}
+
+uchar *SUIDIDevice::universeBuffer(int universe, int buffer) const
+{
+    return m_frame.loadAcquire() +
+           (universe * SUIDI_UNIVERSE_BUFFERS + buffer) * SUIDI_PACKET_SIZE;
+}
+
+uchar *SUIDIDevice::stagingBuffer(int packet) const
+{
+    return m_frame.loadAcquire() +
+           (SUIDI_MAX_UNIVERSES * SUIDI_UNIVERSE_BUFFERS + packet) * SUIDI_PACKET_SIZE;
+}
+
+void SUIDIDevice::writeFrame(bool deadline)
+{
+    /* A reset or re-claim in progress keeps this device idle, without
+       holding up the frame clock of the others */
+    if (m_recoveryMutex.tryLock() == false)
+        return;
+
+    if (m_handle != NULL)
+    {
+        if (needsRecovery() == true)
+            m_scheduler->recoverDevice(this);
+        queueFrame(deadline);
+    }
+
+    m_recoveryMutex.unlock();
+}
+
+void SUIDIDevice::queueFrame(bool deadline)
+{
+    /* Flushed changes come on top of the frames, they neither shift
+       the rate dividers nor tell anything about the bus */
+    if (m_adaptive == true && deadline == true)
+        adaptFrequency();
+
+    /* Firmware that keeps failing batched packets gets one transfer
+       per universe from now on */
+    if (m_batched == true && m_batch.failures.loadRelaxed() >= SUIDI_STALL_THRESHOLD)
+    {
+        qWarning() << "SUIDI with idProduct:" << m_productId << "rejects batched universes";
+        s_batchRejectedMutex.lock();
+        s_batchRejected.insert(m_productId, true);
+        s_batchRejectedMutex.unlock();
+        m_batched = false;
+    }
+
+    /* Inputs captured since the last frame are packed here, off the
+       QLC+ thread */
+    if (m_delivery == DeliverLatest)
+        for (qsizetype i = 0; i < endpoints.count(); i++)
+            collectUniverse(int(i));
+
+    /* Without a free commit the frame still goes out, and is latched
+       together with the next one */
+    CommitTransfer *ct = acquireCommit();
+
+    /* Queue all 512 channels of every universe due with this frame,
+       a batch carries all of them as soon as one is due. Generations
+       are read before the buffers, so a packet is never older than the
+       generation it is recorded with. */
+    int submitted = 0;
+    quint32 frame = deadline ? m_frameCount++ : m_frameCount;
+    qint64 now = monotonicUsecs();
+    int generations[SUIDI_MAX_UNIVERSES];
+    for (qsizetype i = 0; i < endpoints.count(); i++)
+        generations[i] = endpoints.at(i)->generation.loadAcquire();
+
+    if (m_batched == true)
+    {
+        bool due = m_batch.resend.fetchAndStoreAcquire(0) != 0;
+        for (qsizetype i = 0; i < endpoints.count(); i++)
+            if (isUniverseDue(int(i), frame, now) == true)
+                due = true;
+        if (due == true && submitBatch(ct, deadline) == true)
+        {
+            submitted++;
+            for (qsizetype i = 0; i < endpoints.count(); i++)
+                markUniverseSent(int(i), generations[i], now);
+        }
+    }
+    else
+    {
+        for (qsizetype i = 0; i < endpoints.count(); i++)
+        {
+            if (isUniverseDue(int(i), frame, now) == false)
+                continue;
+            if (submitUniverse(int(i), ct, deadline) == true)
+            {
+                submitted++;
+                markUniverseSent(int(i), generations[i], now);
             }
         }
-        m_universe[universeNumber][z] = uchar(0x00);
-        z++;
-        m_universe[universeNumber][z] = uchar(0x00);
-        z++;
-        m_universe[universeNumber][z] = uchar(0x00);
-        z++;
-        m_universe[universeNumber][z] = uchar(0x00);
-        z++;
-        m_universe[universeNumber][z] = uchar(0x00);
-        z++;
-        m_universe[universeNumber][z] = uchar(0x00);
-        z++;
     }
-    m_universe[universeNumber][SUIDI_PACKET_SIZE - 1] = uchar(0xFF);
+
+    if (ct == NULL)
+        return;
+
+    if (submitted == 0)
+        ct->busy.storeRelease(0);
+    else
+        completeFrameTransfer(ct);
+}
+
+double SUIDIDevice::frequency() const
+{
+    return (double)1000000000 / m_framePeriod.loadRelaxed();
+}
+
+void SUIDIDevice::setFrequency(double frequency)
+{
+    frequency = CLAMP(frequency, SUIDI_MIN_FREQUENCY, SUIDI_MAX_FREQUENCY);
+
+    applyFrequency(frequency);
+    QSettings().setValue(QString("%1/%2").arg(SETTINGS_FREQUENCY).arg(m_location), frequency);
+}
+
+void SUIDIDevice::applyFrequency(double frequency)
+{
+    /* The frame clock picks the new period up with the next frame */
+    m_framePeriod.storeRelaxed(int(floor((double)1000000000 / frequency + (double)0.5)));
+}
+
+void SUIDIDevice::adaptFrequency()
+{
+    /* Slowest transfer of the window, and whether any frame found all
+       transfers of an endpoint still on the bus */
+    int dropped = m_batch.dropped.loadRelaxed();
+    int latency = m_batch.lastLatency.loadRelaxed();
+    for (qsizetype i = 0; i < endpoints.count(); i++)
+    {
+        dropped += endpoints.at(i)->dropped.loadRelaxed();
+        latency = qMax(latency, endpoints.at(i)->lastLatency.loadRelaxed());
+    }
+    m_adaptiveLatency = qMax(m_adaptiveLatency, latency);
+
+    if (++m_adaptiveFrames < SUIDI_ADAPTIVE_WINDOW)
+        return;
+
+    /* Back off hard under contention, creep up while the transfers
+       complete well within a frame */
+    double frequency = this->frequency();
+    int period = int(framePeriod() / 1000);
+    if (dropped > m_adaptiveDropped || m_adaptiveLatency > period * 3 / 4)
+        frequency *= 0.75;
+    else if (m_adaptiveLatency < period / 2)
+        frequency *= 1.05;
+    applyFrequency(CLAMP(frequency, m_minFrequency, m_maxFrequency));
+
+    m_adaptiveFrames = 0;
+    m_adaptiveLatency = 0;
+    m_adaptiveDropped = dropped;
+}
+
+int SUIDIDevice::rateDivider(int universe) const
+{
+    return endpoints.at(universe)->rateDivider.loadRelaxed();
+}
+
+void SUIDIDevice::setRateDivider(int universe, int divider)
+{
+    divider = CLAMP(divider, 1, SUIDI_MAX_RATE_DIVIDER);
+
+    endpoints.at(universe)->rateDivider.storeRelaxed(divider);
+    QSettings().setValue(QString("%1/%2/%3").arg(SETTINGS_RATE_DIVIDER)
+                         .arg(m_location).arg(universe + 1), divider);
+}
+
+void SUIDIDevice::loadRates()
+{
+    QSettings settings;
+
+    /* A rate of the device itself wins over the one of the plugin */
+    double frequency = settings.value(SETTINGS_FREQUENCY, SUIDI_DEFAULT_FREQUENCY).toDouble();
+    frequency = settings.value(QString("%1/%2").arg(SETTINGS_FREQUENCY).arg(m_location),
+                               frequency).toDouble();
+    if (frequency <= 0)
+        frequency = SUIDI_DEFAULT_FREQUENCY;
+    frequency = CLAMP(frequency, SUIDI_MIN_FREQUENCY, SUIDI_MAX_FREQUENCY);
+
+    /* An adaptive rate starts out from the configured one */
+    m_adaptive = settings.value(QString("%1/%2").arg(SETTINGS_ADAPTIVE).arg(m_location), false).toBool();
+    m_minFrequency = settings.value(QString("%1/%2").arg(SETTINGS_MIN_FREQUENCY).arg(m_location),
+                                    SUIDI_ADAPTIVE_MIN_FREQUENCY).toDouble();
+    m_maxFrequency = settings.value(QString("%1/%2").arg(SETTINGS_MAX_FREQUENCY).arg(m_location),
+                                    SUIDI_ADAPTIVE_MAX_FREQUENCY).toDouble();
+    m_minFrequency = CLAMP(m_minFrequency, SUIDI_MIN_FREQUENCY, SUIDI_MAX_FREQUENCY);
+    m_maxFrequency = CLAMP(m_maxFrequency, m_minFrequency, SUIDI_MAX_FREQUENCY);
+    m_adaptiveFrames = 0;
+    m_adaptiveLatency = 0;
+    m_adaptiveDropped = 0;
+    if (m_adaptive == true)
+        frequency = CLAMP(frequency, m_minFrequency, m_maxFrequency);
+
+    applyFrequency(frequency);
+
+    for (qsizetype i = 0; i < endpoints.count(); i++)
+    {
+        int divider = settings.value(QString("%1/%2/%3").arg(SETTINGS_RATE_DIVIDER)
+                                     .arg(m_location).arg(int(i + 1)), 1).toInt();
+        endpoints.at(i)->rateDivider.storeRelaxed(CLAMP(divider, 1, SUIDI_MAX_RATE_DIVIDER));
+        /* Everything goes out once after opening */
+        endpoints.at(i)->queuedGeneration = endpoints.at(i)->generation.loadRelaxed() - 1;
+        endpoints.at(i)->resend.storeRelaxed(0);
+        endpoints.at(i)->lastSent = 0;
+    }
+
+    int keepalive = settings.value(QString("%1/%2").arg(SETTINGS_KEEPALIVE).arg(m_location), 0).toInt();
+    m_keepalive.storeRelaxed(CLAMP(keepalive, 0, SUIDI_MAX_KEEPALIVE));
+}
+
+int SUIDIDevice::keepalive() const
+{
+    return m_keepalive.loadRelaxed();
+}
+
+void SUIDIDevice::setKeepalive(int keepalive)
+{
+    keepalive = CLAMP(keepalive, 0, SUIDI_MAX_KEEPALIVE);
+
+    m_keepalive.storeRelaxed(keepalive);
+    QSettings().setValue(QString("%1/%2").arg(SETTINGS_KEEPALIVE).arg(m_location), keepalive);
 }
 
-void SUIDIDevice::stop()
+bool SUIDIDevice::sendsOnChange() const
 {
-    while (isRunning() == true)
+    return m_keepalive.loadRelaxed() > 0;
+}
+
+bool SUIDIDevice::hasChanges() const
+{
+    if (sendsOnChange() == false)
+        return false;
+
+    for (qsizetype i = 0; i < endpoints.count(); i++)
     {
-        // This may occur before the thread sets m_running,
-        // so timeout and try again if necessary
-        m_running = false;
-        wait(100);
+        UniverseEndpoint *ep = endpoints.at(i);
+        if (ep->captures.loadAcquire() != ep->collectedCaptures ||
+            ep->generation.loadAcquire() != ep->queuedGeneration ||
+            (m_delivery != DeliverLatest && m_queues[i].count() > 0))
+            return true;
     }
+    return false;
 }
 
-void SUIDIDevice::run()
+int SUIDIDevice::frameTime() const
 {
     // One "official" DMX frame can take (1s/44Hz) = 23ms
-    int frameTime = (int) floor(((double)1000 / m_frequency) + (double)0.5);
-    int r = 0;
-
-    // Wait for device to settle in case the device was opened just recently
-    // Also measure, whether timer granularity is OK
-    QElapsedTimer time;
-    time.start();
-    usleep(1000);
-    if (time.elapsed() > 3)
-        m_granularity = Bad;
-    else
-        m_granularity = Good;
+    return (int) floor(m_framePeriod.loadRelaxed() / (double)1000000 + (double)0.5);
+}
+
+qint64 SUIDIDevice::framePeriod() const
+{
+    return m_framePeriod.loadRelaxed();
+}
 
-    m_running = true;
-    while (m_running == true)
+void SUIDIDevice::cancelTransfers()
+{
+    for (qsizetype i = 0; i <= endpoints.count(); i++)
     {
-        if (m_handle == NULL)
-            goto framesleep;
-
-        time.restart();
-
-        /* Write all 512 channels */
-        for(qsizetype i = 0;i < endpoints.count();i++){
-            r = libusb_bulk_transfer(m_handle,
-                                     endpoints.at(i)->endpoint,
-                                     m_universe[i],
-                                     SUIDI_PACKET_SIZE,
-                                     &len,
-                                     0);
-            if (r < 0)
-                qWarning() << "SUIDI: unable to write universe:" << libusb_strerror(libusb_error(r));
+        UniverseEndpoint *ep = i < endpoints.count() ? endpoints.at(i) : &m_batch;
+        for (int t = 0; t < SUIDI_FRAMES_IN_FLIGHT; t++)
+            if (ep->transfers[t].busy.loadAcquire() != 0)
+                libusb_cancel_transfer(ep->transfers[t].transfer);
+    }
+
+    for (int f = 0; f < SUIDI_FRAMES_IN_FLIGHT; f++)
+        if (m_commits[f].busy.loadAcquire() != 0)
+            libusb_cancel_transfer(m_commits[f].transfer);
+}
+
+int SUIDIDevice::transfersInFlight() const
+{
+    int transfers = m_batch.inFlight.loadAcquire();
+    for (qsizetype i = 0; i < endpoints.count(); i++)
+        transfers += endpoints.at(i)->inFlight.loadAcquire();
+    for (int f = 0; f < SUIDI_FRAMES_IN_FLIGHT; f++)
+        transfers += m_commits[f].busy.loadAcquire();
+    return transfers;
+}
+
+bool SUIDIDevice::allocateTransfers()
+{
+    int count = int(endpoints.count());
+
+    /* Universes lie back to back in memory the kernel can hand to the
+       host controller directly. Without it they stay in device memory. */
+    m_dmaFrame = libusb_dev_mem_alloc(m_handle, SUIDI_FRAME_SIZE);
+    if (m_dmaFrame != NULL)
+    {
+        memcpy(m_dmaFrame, m_heapFrame, SUIDI_FRAME_SIZE);
+        m_frame.storeRelease(m_dmaFrame);
+    }
+
+    /* Queued frames are copied into packets of their own transfers,
+       the latest frame is sent from the universe buffers directly */
+    for (int i = 0; i < count; i++)
+    {
+        uchar *buffers = NULL;
+        if (m_delivery != DeliverLatest)
+            buffers = stagingBuffer((SUIDI_MAX_UNIVERSES + i) * SUIDI_FRAMES_IN_FLIGHT);
+        endpoints.at(i)->lastPacket = NULL;
+        if (allocateEndpoint(endpoints.at(i), buffers, SUIDI_PACKET_SIZE) == false)
+            return false;
+    }
+
+    /* Whole packets end without a short packet, some firmware needs a
+       zero-length one instead. Off unless set for the product. */
+    bool zeroPacket = QSettings().value(QString("%1/%2").arg(SETTINGS_ZERO_PACKET)
+                                        .arg(QString::number(m_productId, 16)), false).toBool();
+    for (qsizetype i = 0; i < endpoints.count(); i++)
+        endpoints.at(i)->zeroPacket = zeroPacket;
+    m_batch.zeroPacket = zeroPacket;
+
+    s_batchRejectedMutex.lock();
+    bool rejected = s_batchRejected.contains(m_productId);
+    s_batchRejectedMutex.unlock();
+
+    /* Batching only makes sense for several universes on a bulk endpoint */
+    m_batched = count > 1 &&
+                endpoints.at(0)->transferType == LIBUSB_TRANSFER_TYPE_BULK &&
+                QSettings().value(QString("%1/%2").arg(SETTINGS_BATCHED)
+                                  .arg(QString::number(m_productId, 16))).toBool() &&
+                rejected == false;
+
+    m_batch.endpoint = endpoints.at(0)->endpoint;
+    m_batch.maxPacketSize = endpoints.at(0)->maxPacketSize;
+    m_batch.transferType = LIBUSB_TRANSFER_TYPE_BULK;
+    m_batch.isoPackets = 0;
+    m_batch.lastPacket = NULL;
+    if (m_batched == true &&
+        allocateEndpoint(&m_batch, stagingBuffer(0),
+                         SUIDI_MAX_UNIVERSES * SUIDI_PACKET_SIZE) == false)
+        return false;
+
+    for (int f = 0; f < SUIDI_FRAMES_IN_FLIGHT; f++)
+    {
+        CommitTransfer *ct = &m_commits[f];
+        ct->busy.storeRelaxed(0);
+        ct->transfer = libusb_alloc_transfer(0);
+        if (ct->transfer == NULL)
+            return false;
+
+        libusb_fill_control_setup(ct->control,
+                                  SUIDI_COMMIT_REQUEST_TYPE,
+                                  SUIDI_COMMIT_REQUEST,
+                                  0x0000, 0x0000,
+                                  SUIDI_COMMIT_LENGTH);
+        libusb_fill_control_transfer(ct->transfer, m_handle, ct->control,
+                                     commitCallback, ct,
+                                     SUIDI_COMMIT_TIMEOUT);
+    }
+
+    return true;
+}
+
+bool SUIDIDevice::allocateEndpoint(UniverseEndpoint *ep, uchar *buffers, int length)
+{
+    ep->inFlight.storeRelaxed(0);
+    ep->failures.storeRelaxed(0);
+    ep->recovery.storeRelaxed(RecoveryNone);
+    ep->lastLatency.storeRelaxed(0);
+    ep->maxLatency.storeRelaxed(0);
+    ep->dropped.storeRelaxed(0);
+    ep->lastLength.storeRelaxed(0);
+    ep->shortWrites.storeRelaxed(0);
+    ep->queueDrops.storeRelaxed(0);
+    ep->unchangedInputs.storeRelaxed(0);
+    ep->unchangedFrames.storeRelaxed(0);
+    ep->blockHits.storeRelaxed(0);
+    ep->blockMisses.storeRelaxed(0);
+
+    for (int t = 0; t < SUIDI_FRAMES_IN_FLIGHT; t++)
+    {
+        EndpointTransfer *et = &ep->transfers[t];
+        et->busy.storeRelaxed(0);
+        et->packet = buffers != NULL ? buffers + t * length : NULL;
+        et->sending = NULL;
+        et->length = length;
+        et->transfer = libusb_alloc_transfer(ep->isoPackets);
+        if (et->transfer == NULL)
+            return false;
+
+        /* Interrupt and iso endpoints get their guaranteed bandwidth,
+           bulk shares whatever is left on the bus */
+        switch (ep->transferType)
+        {
+            case LIBUSB_TRANSFER_TYPE_INTERRUPT:
+                libusb_fill_interrupt_transfer(et->transfer, m_handle, ep->endpoint,
+                                               et->packet, length,
+                                               transferCallback, ep, 0);
+            break;
+            case LIBUSB_TRANSFER_TYPE_ISOCHRONOUS:
+                libusb_fill_iso_transfer(et->transfer, m_handle, ep->endpoint,
+                                         et->packet, length, ep->isoPackets,
+                                         transferCallback, ep, 0);
+                libusb_set_iso_packet_lengths(et->transfer, ep->maxPacketSize);
+                /* The last packet only carries what is left */
+                et->transfer->iso_packet_desc[ep->isoPackets - 1].length =
+                        length - (ep->isoPackets - 1) * ep->maxPacketSize;
+            break;
+            default:
+                libusb_fill_bulk_transfer(et->transfer, m_handle, ep->endpoint,
+                                          et->packet, length,
+                                          transferCallback, ep, 0);
+            break;
         }
+    }
+
+    return true;
+}
 
-        r = libusb_control_transfer(m_handle,
-                                    0xc0,
-                                    0x08,
-                                    0x0000,
-                                    0x0000,
-                                    new uchar (0x00),
-                                    0x02,
-                                    10);
-        if (r < 0)
-            qWarning() << "SUIDI: unable to write universe:" << libusb_strerror(libusb_error(r));
-
-framesleep:
-        // Sleep for the remainder of the DMX frame time
-        if (m_granularity == Good)
-            while (time.elapsed() < frameTime) { usleep(1000); }
+void SUIDIDevice::freeTransfers()
+{
+    for (qsizetype i = 0; i <= endpoints.count(); i++)
+    {
+        UniverseEndpoint *ep = i < endpoints.count() ? endpoints.at(i) : &m_batch;
+        for (int t = 0; t < SUIDI_FRAMES_IN_FLIGHT; t++)
+        {
+            libusb_free_transfer(ep->transfers[t].transfer);
+            ep->transfers[t].transfer = NULL;
+        }
+    }
+
+    for (int f = 0; f < SUIDI_FRAMES_IN_FLIGHT; f++)
+    {
+        libusb_free_transfer(m_commits[f].transfer);
+        m_commits[f].transfer = NULL;
+    }
+
+    releaseFrame();
+}
+
+bool SUIDIDevice::submitUniverse(int universe, CommitTransfer *commit, bool deadline)
+{
+    UniverseEndpoint *ep = endpoints.at(universe);
+
+    /* Endpoints waiting for recovery are left out, so the healthy
+       ones keep refreshing */
+    if (ep->failures.loadRelaxed() >= SUIDI_STALL_THRESHOLD)
+        return false;
+
+    EndpointTransfer *et = idleTransfer(ep, deadline);
+    if (et == NULL)
+        return false;
+
+    /* Queued frames only leave the queue once a transfer can take them */
+    if (m_delivery != DeliverLatest)
+    {
+        dequeueUniverse(universe, et->packet, ep->lastPacket);
+        ep->lastPacket = et->packet;
+        et->sending = NULL;
+        return submitTransfer(ep, et, commit);
+    }
+
+    /* The latest complete packet stays untouched by the packer for as
+       long as the transfer is sending it */
+    int buffer = m_buffers[universe].front();
+    et->packet = universeBuffer(universe, buffer);
+    et->sending = m_buffers[universe].sending(buffer);
+    et->sending->ref();
+
+    if (submitTransfer(ep, et, commit) == false)
+    {
+        et->sending->deref();
+        return false;
+    }
+
+    return true;
+}
+
+bool SUIDIDevice::submitBatch(CommitTransfer *commit, bool deadline)
+{
+    EndpointTransfer *et = idleTransfer(&m_batch, deadline);
+    if (et == NULL)
+        return false;
+
+    /* Each universe picks its latest buffer or its next queued frame
+       on its own, so the batch is gathered into one contiguous packet */
+    for (qsizetype i = 0; i < endpoints.count(); i++)
+    {
+        uchar *packet = et->packet + i * SUIDI_PACKET_SIZE;
+        if (m_delivery != DeliverLatest)
+            dequeueUniverse(int(i), packet, m_batch.lastPacket == NULL ? NULL :
+                                            m_batch.lastPacket + i * SUIDI_PACKET_SIZE);
         else
-            while (time.elapsed() < frameTime) { /* Busy sleep */ }
+            memcpy(packet, universeBuffer(int(i), m_buffers[i].front()), SUIDI_PACKET_SIZE);
+    }
+    m_batch.lastPacket = et->packet;
+    et->length = int(endpoints.count()) * SUIDI_PACKET_SIZE;
+
+    return submitTransfer(&m_batch, et, commit);
+}
+
+void SUIDIDevice::releaseFrame()
+{
+    if (m_dmaFrame == NULL)
+        return;
+
+    /* Packing moves back to device memory before the mapping goes,
+       the transfers reading it have all completed by now */
+    memcpy(m_heapFrame, m_dmaFrame, SUIDI_FRAME_SIZE);
+    m_frame.storeRelease(m_heapFrame);
+    libusb_dev_mem_free(m_handle, m_dmaFrame, SUIDI_FRAME_SIZE);
+    m_dmaFrame = NULL;
+}
+
+EndpointTransfer *SUIDIDevice::idleTransfer(UniverseEndpoint *ep, bool deadline)
+{
+    for (int t = 0; t < SUIDI_FRAMES_IN_FLIGHT; t++)
+        if (ep->transfers[t].busy.loadAcquire() == 0)
+            return &ep->transfers[t];
+
+    /* With all of its transfers still on the bus this endpoint skips
+       the frame, its universe goes out with the next one instead */
+    if (deadline == true)
+        ep->dropped.ref();
+
+    return NULL;
+}
+
+bool SUIDIDevice::submitTransfer(UniverseEndpoint *ep, EndpointTransfer *et,
+                                 CommitTransfer *commit)
+{
+    /* A transfer may queue behind the ones already on the bus, but
+       must never outlive them by more than that */
+    et->transfer->buffer = et->packet;
+    et->transfer->length = et->length;
+    setZeroPacket(ep, et->transfer);
+    et->transfer->timeout = static_cast<unsigned int>(frameTime() * SUIDI_FRAMES_IN_FLIGHT);
+    et->submitted = monotonicUsecs();
+    et->deadline = et->submitted + frameTime() * 1000;
+    et->written = 0;
+    et->retries = 0;
+    et->commit = commit;
+    et->busy.storeRelaxed(1);
+    ep->inFlight.ref();
+    if (commit != NULL)
+        commit->pending.ref();
+
+    int r = libusb_submit_transfer(et->transfer);
+    if (r < 0)
+    {
+        qWarning() << "SUIDI: unable to write universe:" << libusb_strerror(libusb_error(r));
+        if (commit != NULL)
+            commit->pending.deref();
+        ep->inFlight.deref();
+        et->busy.storeRelease(0);
+        return false;
     }
+
+    return true;
+}
+
+bool SUIDIDevice::probeCommit()
+{
+    if (s_commitRequired.contains(m_productId))
+        return s_commitRequired.value(m_productId);
+
+    /* Firmware without a latch stalls the vendor request, anything
+       else is treated as needing it */
+    uchar buf[SUIDI_COMMIT_LENGTH];
+    int r = libusb_control_transfer(m_handle,
+                                    SUIDI_COMMIT_REQUEST_TYPE,
+                                    SUIDI_COMMIT_REQUEST,
+                                    0x0000, 0x0000,
+                                    buf, SUIDI_COMMIT_LENGTH,
+                                    SUIDI_PROBE_TIMEOUT);
+    if (r < 0 && r != LIBUSB_ERROR_PIPE)
+    {
+        qWarning() << "SUIDI: unable to probe commit request:" << libusb_strerror(libusb_error(r));
+        return true;
+    }
+
+    bool required = (r != LIBUSB_ERROR_PIPE);
+    qDebug() << "SUIDI with idProduct:" << m_productId << "commit required:" << required;
+    s_commitRequired.insert(m_productId, required);
+
+    return required;
+}
+
+CommitTransfer *SUIDIDevice::acquireCommit()
+{
+    if (m_commitRequired == false)
+        return NULL;
+
+    for (int f = 0; f < SUIDI_FRAMES_IN_FLIGHT; f++)
+    {
+        CommitTransfer *ct = &m_commits[f];
+        if (ct->busy.loadAcquire() == 0)
+        {
+            /* Held until the frame's bulk transfers are all queued */
+            ct->busy.storeRelaxed(1);
+            ct->pending.storeRelaxed(1);
+            return ct;
+        }
+    }
+
+    return NULL;
+}
+
+/****************************************************************************
+ * Stall recovery
+ ****************************************************************************/
+
+bool SUIDIDevice::needsRecovery() const
+{
+    /* The remaining transfers of a failing endpoint time out first */
+    for (qsizetype i = 0; i < endpoints.count(); i++)
+        if (endpoints.at(i)->failures.loadRelaxed() >= SUIDI_STALL_THRESHOLD &&
+            endpoints.at(i)->inFlight.loadAcquire() == 0)
+            return true;
+    return false;
+}
+
+void SUIDIDevice::recoverEndpoints()
+{
+    if (m_handle == NULL)
+        return;
+
+    for (qsizetype i = 0; i < endpoints.count(); i++)
+    {
+        UniverseEndpoint *ep = endpoints.at(i);
+
+        if (ep->failures.loadRelaxed() < SUIDI_STALL_THRESHOLD)
+            continue;
+
+        if (ep->inFlight.loadAcquire() > 0)
+            continue;
+
+        int step = ep->recovery.loadRelaxed() + 1;
+        if (step > RecoveryReclaim)
+            step = RecoveryClearHalt;
+
+        /* Failing endpoints are left out by the writer, so only a reset
+           or re-claim, which affect every endpoint, stop the device and
+           wait until it is idle */
+        bool ok = false;
+        if (step == RecoveryClearHalt)
+        {
+            qWarning() << "SUIDI: clearing halt on endpoint" << ep->endpoint;
+            ok = libusb_clear_halt(m_handle, ep->endpoint) == 0;
+        }
+        else
+        {
+            m_recoveryMutex.lock();
+            while (transfersInFlight() > 0)
+                QThread::msleep(1);
+
+            if (step == RecoveryReset)
+            {
+                qWarning() << "SUIDI: resetting" << name() << "for endpoint" << ep->endpoint;
+                ok = resetDevice();
+            }
+            else
+            {
+                qWarning() << "SUIDI: re-claiming" << name() << "for endpoint" << ep->endpoint;
+                ok = reclaimInterface();
+            }
+            m_recoveryMutex.unlock();
+        }
+
+        if (ok == false)
+            qWarning() << "SUIDI: recovery step" << step << "failed on endpoint" << ep->endpoint;
+
+        ep->recovery.storeRelaxed(step);
+        ep->failures.storeRelaxed(0);
+
+        if (m_handle == NULL)
+            return;
+    }
+}
+
+bool SUIDIDevice::resetDevice()
+{
+    int r = libusb_reset_device(m_handle);
+    if (r == 0)
+        return true;
+
+    if (r != LIBUSB_ERROR_NOT_FOUND)
+        return false;
+
+    /* The device re-enumerated and this libusb device is gone for good,
+       a re-scan of the hardware finds it again as a new one */
+    qWarning() << "SUIDI:" << name() << "re-enumerated after the reset, re-scan the hardware to use it again";
+    libusb_close(m_handle);
+    m_handle = NULL;
+    m_lost = true;
+
+    return false;
+}
+
+bool SUIDIDevice::reclaimInterface()
+{
+    libusb_release_interface(m_handle, SUIDI_INTERFACE);
+    return libusb_claim_interface(m_handle, SUIDI_INTERFACE) == 0;
 }
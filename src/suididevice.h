@@ -1,23 +1,146 @@
 #ifndef SUIDIDEVICE_H
 #define SUIDIDEVICE_H
 
-#include <QThread>
+#include <QAtomicPointer>
+#include <QAtomicInt>
+#include <QByteArray>
+#include <QMutex>
+#include <QObject>
+
+#include "suiditriplebuffer.h"
+#include "suidiframequeue.h"
+#include "suidipacket.h"
 
 #define SUIDI_PACKET_SIZE 576
 #define SUIDI_MAX_UNIVERSES 4
 #define SUIDI_DEFAULT_FREQUENCY 44
+#define SUIDI_MIN_FREQUENCY 1
+#define SUIDI_MAX_FREQUENCY 1000
+#define SUIDI_MAX_RATE_DIVIDER 255
+#define SUIDI_MAX_KEEPALIVE 60000
+/* Default bounds of an adaptive refresh rate */
+#define SUIDI_ADAPTIVE_MIN_FREQUENCY 25
+#define SUIDI_ADAPTIVE_MAX_FREQUENCY 200
+/* Frames measured before an adaptive rate is adjusted */
+#define SUIDI_ADAPTIVE_WINDOW 16
+#define SUIDI_FRAMES_IN_FLIGHT 2
+#define SUIDI_COMMIT_LENGTH 2
+#define SUIDI_CONTROL_SETUP_SIZE 8
+#define SUIDI_STALL_THRESHOLD 3
+#define SUIDI_SHORT_WRITE_RETRIES 2
+/* A buffer per transfer in flight, plus the ready and the back buffer */
+#define SUIDI_UNIVERSE_BUFFERS (SUIDI_FRAMES_IN_FLIGHT + 2)
+/* Frames a universe can hold back in queued delivery */
+#define SUIDI_QUEUE_FRAMES 8
+#define SUIDI_CAPTURE_SLOTS 3
+/* Universe buffers followed by the batched and the queued packets */
+#define SUIDI_FRAME_SIZE (SUIDI_MAX_UNIVERSES * SUIDI_PACKET_SIZE * \
+                          (SUIDI_UNIVERSE_BUFFERS + 2 * SUIDI_FRAMES_IN_FLIGHT))
 
 struct libusb_device;
 struct libusb_device_handle;
 struct libusb_device_descriptor;
+struct libusb_transfer;
+class SUIDIScheduler;
+
+/** The 0x08 commit request latching the universes of a frame. It is
+    submitted as soon as the last bulk transfer of its frame completes,
+    while the next frame is already being written. */
+typedef struct {
+    struct libusb_transfer *transfer;
+    uchar control[SUIDI_CONTROL_SETUP_SIZE + SUIDI_COMMIT_LENGTH];
+    /** Bulk transfers of the frame that have not completed yet */
+    QAtomicInt pending;
+    QAtomicInt busy;
+
+} CommitTransfer;
+
+/** A transfer owned by one endpoint together with the packet it sends */
+typedef struct {
+    struct libusb_transfer *transfer;
+    /** One universe, or all of them back to back in batched mode */
+    uchar *packet;
+    int length;
+    /** Commit of the frame this transfer belongs to, if any */
+    CommitTransfer *commit;
+    /** Send count of the universe buffer, released on completion */
+    QAtomicInt *sending;
+    /** Submission time in microseconds, for the endpoint latency */
+    qint64 submitted;
+    /** Time by which a short write must have been completed */
+    qint64 deadline;
+    /** Bytes of the packet accepted by the device so far */
+    int written;
+    int retries;
+    QAtomicInt busy;
+
+} EndpointTransfer;
 
+/** Output pipeline of one universe. Every endpoint queues and completes
+    its transfers on its own, so a slow endpoint never holds back the
+    others. */
 typedef struct {
     uint8_t endpoint;
     bool opened;
+    /** wMaxPacketSize of the endpoint, a packet spans several of these */
+    quint16 maxPacketSize;
+    /** Transfer type from bmAttributes: bulk, interrupt or isochronous */
+    uint8_t transferType;
+    /** Number of iso packets carrying one packet */
+    int isoPackets;
+    /** Whether the firmware needs a zero-length packet to end a bulk or
+        interrupt transfer that fills its last packet exactly */
+    bool zeroPacket;
+    /** Bandwidth reserved by an interrupt or iso endpoint (bytes/s) */
+    int reservedBandwidth;
+    EndpointTransfer transfers[SUIDI_FRAMES_IN_FLIGHT];
+    /** Transfers of this endpoint currently on the bus */
+    QAtomicInt inFlight;
+    /** Consecutive transfers that timed out or stalled */
+    QAtomicInt failures;
+    /** Last recovery step applied, cleared by a completed transfer */
+    QAtomicInt recovery;
+    /** Submit to completion time of the last and slowest transfer (us) */
+    QAtomicInt lastLatency;
+    QAtomicInt maxLatency;
+    /** Frames skipped because every transfer was still on the bus */
+    QAtomicInt dropped;
+    /** Bytes accepted for the last completed packet */
+    QAtomicInt lastLength;
+    /** Transfers the device accepted only partially */
+    QAtomicInt shortWrites;
+    /** Packet of the last submitted transfer in queued delivery, sent
+        again while no new frame is waiting */
+    uchar *lastPacket;
+    /** Queued frames discarded because the queue was full */
+    QAtomicInt queueDrops;
+    /** The universe goes out with every n-th frame of the device */
+    QAtomicInt rateDivider;
+    /** Bumped by the packer with every input that differs from the one
+        before, the writer sends the universe again once it moved on */
+    QAtomicInt generation;
+    /** Generation of the last packet queued on the bus */
+    int queuedGeneration;
+    /** Set when a transfer did not make it, so the universe goes out
+        again even though it has not changed */
+    QAtomicInt resend;
+    /** Time the universe last went out (us), for the keepalive */
+    qint64 lastSent;
+    /** Inputs captured from QLC+ in latest delivery, and the number of
+        them the writer has picked up and packed */
+    QAtomicInt captures;
+    int collectedCaptures;
+    /** Inputs found equal to the previous one and not packed */
+    QAtomicInt unchangedInputs;
+    /** Frames the universe was left out of because nothing changed */
+    QAtomicInt unchangedFrames;
+    /** Blocks of packed universes reused as they were, and re-copied */
+    QAtomicInt blockHits;
+    QAtomicInt blockMisses;
 
 } UniverseEndpoint;
 
-class SUIDIDevice : public QThread
+class SUIDIDevice : public QObject
 {
     Q_OBJECT
 
@@ -25,7 +148,8 @@ class SUIDIDevice : public QThread
      * Initialization
      ********************************************************************/
 public:
-    SUIDIDevice(libusb_device *device, libusb_device_descriptor *desc, QObject* parent = 0);
+    SUIDIDevice(SUIDIScheduler *scheduler, libusb_device *device,
+                libusb_device_descriptor *desc, QObject* parent = 0);
     virtual ~SUIDIDevice();
 
     /** Find out, whether the given USB device is a SUIDI device */
@@ -42,10 +166,12 @@ public:
     }
 
 private:
-    void extractNameEndpoints();
+    void extractNameEndpoints(const libusb_device_descriptor *desc);
 
 private:
     QString m_name;
+    /** Bus and port path, identifying the device in the settings */
+    QString m_location;
 
     /********************************************************************
      * Open & close
@@ -57,33 +183,243 @@ public:
     const libusb_device *device() const;
 
 private:
+    SUIDIScheduler* m_scheduler;
     struct libusb_device* m_device;
-    struct libusb_device_descriptor *m_descriptor;
+    quint16 m_productId;
     struct libusb_device_handle* m_handle;
     struct libusb_config_descriptor *m_config;
-    int len = 64;
     QList<UniverseEndpoint*> endpoints;
 
     /********************************************************************
-     * Thread
+     * Frames
+     ********************************************************************/
+public:
+    /** How frames handed over by QLC+ reach the bus */
+    enum DeliveryMode
+    {
+        /** Every transfer sends the latest frame, older ones are skipped */
+        DeliverLatest = 0,
+        /** Every frame is sent in order, a full queue drops the oldest */
+        DeliverQueuedDropOldest,
+        /** Every frame is sent in order, a full queue holds QLC+ back */
+        DeliverQueuedLockStep
+    };
+
+    /** What happens to the channels a universe shorter than 512 does
+        not supply */
+    enum ShortUniversePolicy
+    {
+        /** Missing channels go to zero */
+        ShortZeroFill = 0,
+        /** Missing channels keep their last value */
+        ShortKeepLast
+    };
+
+    void outputDMX(quint32 universeNumber, const QByteArray& universe,
+                   bool dataChanged = true);
+
+    /** Queue the current universes on the bus, called by the scheduler
+        once per frame deadline, and in between to flush changes */
+    void writeFrame(bool deadline = true);
+
+    /** Refresh rate of the device in Hz */
+    double frequency() const;
+
+    /** Change the refresh rate at once and remember it for the device */
+    void setFrequency(double frequency);
+
+    /** Frames of the device per frame of the given universe */
+    int rateDivider(int universe) const;
+
+    /** Refresh the given universe with every n-th frame only, at once
+        and remembered for the device */
+    void setRateDivider(int universe, int divider);
+
+    /** Interval unchanged universes are sent again at when sending on
+        change (ms), 0 to send every universe with every frame */
+    int keepalive() const;
+
+    /** Switch sending on change on or off at once, and remember it
+        for the device */
+    void setKeepalive(int keepalive);
+
+    /** Whether changed universes wake the frame clock */
+    bool sendsOnChange() const;
+
+    /** Whether a changed universe is waiting to be sent */
+    bool hasChanges() const;
+
+    /** Frame period in milliseconds */
+    int frameTime() const;
+
+    /** Exact frame period in nanoseconds, for the frame clock */
+    qint64 framePeriod() const;
+
+    /** Cancel all transfers still on the bus */
+    void cancelTransfers();
+
+    /** Number of transfers of all endpoints still on the bus */
+    int transfersInFlight() const;
+
+private:
+    /** Allocate and prepare the transfers of all endpoints, reused for
+        every frame until the device is closed. libusb itself still
+        allocates its URBs with every submission on Linux. */
+    bool allocateTransfers();
+
+    /** Allocate and prepare the transfers of one endpoint. Packets of
+        the given length come from the given buffers, one per transfer,
+        or are picked from the universe buffers at submission if NULL. */
+    bool allocateEndpoint(UniverseEndpoint *ep, uchar *buffers, int length);
+
+    /** Queue the frame of the device once it is safe to use. Only
+        deadline frames count towards the rate dividers and the
+        adaptive rate. */
+    void queueFrame(bool deadline);
+
+    /** Restore the refresh rates remembered for the device */
+    void loadRates();
+
+    /** Switch the frame period over to the given rate */
+    void applyFrequency(double frequency);
+
+    /** Move an adaptive rate towards what the bus sustains, judged by
+        how long the transfers of the last frames took to complete */
+    void adaptFrequency();
+
+    /** Memory of the given buffer of a universe */
+    uchar *universeBuffer(int universe, int buffer) const;
+
+    /** Memory of the given packet owned by a transfer, the batched
+        packets come first and the queued ones after them */
+    uchar *stagingBuffer(int packet) const;
+
+    /** Make room in the queue of a universe according to the delivery
+        mode, counting every frame that has to go */
+    void reserveQueue(int universe);
+
+    /** Compare an input block by block against the previous one of its
+        universe and keep it. Returns the bitmap of changed blocks. */
+    uint inputChanged(int universe, const QByteArray& data);
+
+    /** Pack the latest input QLC+ handed over for a universe into its
+        back buffer and publish it, on the writer thread */
+    void collectUniverse(int universe);
+
+    /** Bring the given buffer of a universe up to the latest input,
+        copying only the blocks that changed since it was last packed */
+    void packUniverse(int universe, uchar *packet, int buffer);
+
+    /** Whether the given universe goes out with the current frame */
+    bool isUniverseDue(int universe, quint32 frame, qint64 now);
+
+    /** Remember the generation and time a universe was queued at */
+    void markUniverseSent(int universe, int generation, qint64 now);
+
+    /** Copy the next queued frame of a universe into the given packet,
+        or the last packet again while the queue is empty */
+    void dequeueUniverse(int universe, uchar *packet, const uchar *last);
+
+    /** Return a DMA frame buffer to the kernel, packing goes on in
+        device memory */
+    void releaseFrame();
+
+    /** Release the transfers of all endpoints */
+    void freeTransfers();
+
+    /** Queue the current packet of the given universe on its endpoint,
+        the transfer counts towards the given frame commit */
+    bool submitUniverse(int universe, CommitTransfer *commit, bool deadline);
+
+    /** Queue all universes back to back in one transfer */
+    bool submitBatch(CommitTransfer *commit, bool deadline);
+
+    /** Idle transfer of the given endpoint, NULL when all are busy.
+        A deadline frame finding none counts as dropped. */
+    EndpointTransfer *idleTransfer(UniverseEndpoint *ep, bool deadline);
+
+    /** Queue the given transfer, counting it towards the given commit */
+    bool submitTransfer(UniverseEndpoint *ep, EndpointTransfer *et,
+                        CommitTransfer *commit);
+
+    /** Find out once per product, whether the firmware needs the
+        commit request to latch the transferred universes */
+    bool probeCommit();
+
+    /** Claim a free commit transfer for the frame being queued */
+    CommitTransfer *acquireCommit();
+
+    /********************************************************************
+     * Stall recovery
      ********************************************************************/
 public:
-    void outputDMX(quint32 universeNumber, const QByteArray& universe);
+    /** Escalate recovery of every endpoint that keeps failing, called
+        by the recovery thread of the scheduler */
+    void recoverEndpoints();
 
 private:
-    enum TimerGranularity { Unknown, Good, Bad };
+    enum RecoveryStep { RecoveryNone, RecoveryClearHalt, RecoveryReset, RecoveryReclaim };
+
+    /** Whether an idle endpoint keeps failing and waits for recovery */
+    bool needsRecovery() const;
 
-    /** Stop the writer thread */
-    void stop();
+    /** Reset the device, giving it up if it re-enumerated */
+    bool resetDevice();
 
-    /** DMX writer thread worker method */
-    void run();
+    /** Release and claim the interface again */
+    bool reclaimInterface();
+
+    /** Held by the recovery thread for a reset or re-claim, the writer
+        leaves the device alone meanwhile */
+    QMutex m_recoveryMutex;
+    /** Set once a reset re-enumerated the device, only a re-scan of the
+        hardware finds it again */
+    bool m_lost;
 
 private:
-    bool m_running;
-    uchar m_universe[SUIDI_MAX_UNIVERSES][SUIDI_PACKET_SIZE];
-    double m_frequency;
-    TimerGranularity m_granularity;
+    CommitTransfer m_commits[SUIDI_FRAMES_IN_FLIGHT];
+    bool m_commitRequired;
+
+    /** Single pipeline carrying every universe on the first endpoint,
+        for firmware that accepts the packets back to back */
+    UniverseEndpoint m_batch;
+    bool m_batched;
+    /** Tear-free handoff of every universe to the transfers */
+    SUIDITripleBuffer<SUIDI_UNIVERSE_BUFFERS> m_buffers[SUIDI_MAX_UNIVERSES];
+    /** Inputs of every universe in latest delivery, shared with QLC+
+        and handed over to the writer for packing */
+    SUIDITripleBuffer<SUIDI_CAPTURE_SLOTS> m_captureSlots[SUIDI_MAX_UNIVERSES];
+    QByteArray m_captures[SUIDI_MAX_UNIVERSES][SUIDI_CAPTURE_SLOTS];
+    /** Last input of every universe, for telling real changes apart */
+    uchar m_inputs[SUIDI_MAX_UNIVERSES][SUIDI_PACKET_CHANNELS];
+    /** Number of changed inputs of every universe, the input each block
+        last changed with, and the input each universe buffer and each
+        queue slot was last packed with */
+    quint32 m_inputCount[SUIDI_MAX_UNIVERSES];
+    quint32 m_blockStamps[SUIDI_MAX_UNIVERSES][SUIDI_PACKET_BLOCKS];
+    quint32 m_packStamps[SUIDI_MAX_UNIVERSES][SUIDI_UNIVERSE_BUFFERS + SUIDI_QUEUE_FRAMES];
+    ShortUniversePolicy m_shortPolicy;
+    /** In order handoff of every universe in queued delivery */
+    DeliveryMode m_delivery;
+    SUIDIFrameQueue<SUIDI_QUEUE_FRAMES, SUIDI_PACKET_SIZE> m_queues[SUIDI_MAX_UNIVERSES];
+    /** Buffers of all universes. The transfers send them from here,
+        which is DMA capable memory where the platform has it. */
+    QAtomicPointer<uchar> m_frame;
+    uchar *m_dmaFrame;
+    uchar m_heapFrame[SUIDI_FRAME_SIZE];
+    /** Frame period in nanoseconds, changeable while streaming */
+    QAtomicInt m_framePeriod;
+    /** Frames written since open, picks the universes of rate dividers */
+    quint32 m_frameCount;
+    QAtomicInt m_keepalive;
+
+    /** Adaptive rate bounds, and the measurements of the current window */
+    bool m_adaptive;
+    double m_minFrequency;
+    double m_maxFrequency;
+    int m_adaptiveFrames;
+    int m_adaptiveLatency;
+    int m_adaptiveDropped;
 };
 
 #endif
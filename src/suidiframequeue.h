@@ -0,0 +1,105 @@
+#ifndef SUIDIFRAMEQUEUE_H
+#define SUIDIFRAMEQUEUE_H
+
+#include <QAtomicInt>
+#include <cstring>
+
+/**
+ * Bounded lock-free queue of packed frames between one producer and one
+ * consumer, delivering every frame in order.
+ *
+ * The producer packs straight into the slot at the head and pushes it.
+ * The consumer copies the frame at the tail out and then claims it by
+ * moving the tail on. When the queue is full the producer may drop the
+ * oldest frame by moving the tail itself. A consumer that was copying
+ * that frame at the same moment fails to claim it and retries with the
+ * next one, so a half-overwritten frame is never delivered.
+ */
+template <int Frames, int Size>
+class SUIDIFrameQueue
+{
+public:
+    SUIDIFrameQueue()
+        : m_head(0)
+        , m_tail(0)
+    {
+    }
+
+    /** Preset every slot with the given frame, before either side runs */
+    void fill(const uchar *frame)
+    {
+        for (int i = 0; i < Frames; i++)
+            memcpy(m_frames[i], frame, Size);
+    }
+
+    /** Frames waiting to be delivered */
+    int count() const
+    {
+        return m_head.loadAcquire() - m_tail.loadAcquire();
+    }
+
+    /********************************************************************
+     * Producer
+     ********************************************************************/
+public:
+    bool isFull() const
+    {
+        return count() >= Frames;
+    }
+
+    /** Slot to pack the next frame into, only valid while not full */
+    uchar *back()
+    {
+        return m_frames[backIndex()];
+    }
+
+    /** Index of that slot, it still holds the frame packed Frames
+        pushes ago */
+    int backIndex() const
+    {
+        return m_head.loadRelaxed() % Frames;
+    }
+
+    /** Queue the frame packed into back() */
+    void push()
+    {
+        m_head.storeRelease(m_head.loadRelaxed() + 1);
+    }
+
+    /** Discard the oldest waiting frame to make room for a new one */
+    bool dropOldest()
+    {
+        int tail = m_tail.loadAcquire();
+        if (m_head.loadRelaxed() - tail < Frames)
+            return false;
+        return m_tail.testAndSetOrdered(tail, tail + 1);
+    }
+
+    /********************************************************************
+     * Consumer
+     ********************************************************************/
+public:
+    /** Copy the oldest frame into the given packet and remove it.
+        Returns false when no frame is waiting. */
+    bool pop(uchar *packet)
+    {
+        forever
+        {
+            int tail = m_tail.loadAcquire();
+            if (m_head.loadAcquire() == tail)
+                return false;
+
+            memcpy(packet, m_frames[tail % Frames], Size);
+
+            if (m_tail.testAndSetOrdered(tail, tail + 1))
+                return true;
+        }
+    }
+
+private:
+    QAtomicInt m_head;
+    QAtomicInt m_tail;
+    uchar m_frames[Frames][Size];
+};
+
+#endif
@@ -0,0 +1,86 @@
+#ifndef SUIDIPACKET_H
+#define SUIDIPACKET_H
+
+#include <QtGlobal>
+#include <cstring>
+
+/* A SUIDI packet carries the 512 channels of a universe in 9 blocks.
+   Each block starts with its index, holds up to 57 channels and ends
+   with 6 bytes of padding. A 0xFF byte closes the packet. */
+#define SUIDI_PACKET_CHANNELS 512
+#define SUIDI_PACKET_BLOCKS 9
+#define SUIDI_BLOCK_CHANNELS 57
+#define SUIDI_BLOCK_PADDING 6
+#define SUIDI_BLOCK_SIZE (1 + SUIDI_BLOCK_CHANNELS + SUIDI_BLOCK_PADDING)
+#define SUIDI_PACKET_END 0xFF
+#define SUIDI_ALL_BLOCKS ((1u << SUIDI_PACKET_BLOCKS) - 1)
+
+/** Where the channels of one block lie in the universe and the packet */
+typedef struct {
+    int offset;
+    int channel;
+    int length;
+
+} SUIDIPacketSlice;
+
+constexpr SUIDIPacketSlice suidiPacketSlice(int block)
+{
+    return SUIDIPacketSlice {
+        block * SUIDI_BLOCK_SIZE + 1,
+        block * SUIDI_BLOCK_CHANNELS,
+        (block + 1) * SUIDI_BLOCK_CHANNELS <= SUIDI_PACKET_CHANNELS ?
+            SUIDI_BLOCK_CHANNELS : SUIDI_PACKET_CHANNELS - block * SUIDI_BLOCK_CHANNELS
+    };
+}
+
+/** Bytes of a complete packet, the last block is a short one */
+constexpr int suidiPacketLength()
+{
+    return suidiPacketSlice(SUIDI_PACKET_BLOCKS - 1).offset +
+           suidiPacketSlice(SUIDI_PACKET_BLOCKS - 1).length + SUIDI_BLOCK_PADDING + 1;
+}
+
+static_assert(suidiPacketSlice(SUIDI_PACKET_BLOCKS - 1).channel +
+              suidiPacketSlice(SUIDI_PACKET_BLOCKS - 1).length == SUIDI_PACKET_CHANNELS,
+              "SUIDI blocks must carry exactly one universe");
+
+/** Lay down the block indices, padding and end marker of a packet, with
+    all channels at zero. The packers below never touch them again. */
+inline void suidiPacketHeader(uchar *packet)
+{
+    memset(packet, 0, suidiPacketLength());
+    for (int block = 0; block < SUIDI_PACKET_BLOCKS; block++)
+        packet[block * SUIDI_BLOCK_SIZE] = uchar(block);
+    packet[suidiPacketLength() - 1] = uchar(SUIDI_PACKET_END);
+}
+
+/** Copy the channels of the given blocks into the payload slices of a
+    packet, one block copy of a size known at compile time per slice */
+template <int Block = 0>
+inline void suidiPackBlocks(uchar *packet, const uchar *channels, uint blocks)
+{
+    constexpr SUIDIPacketSlice slice = suidiPacketSlice(Block);
+    if (blocks & (1u << Block))
+        memcpy(packet + slice.offset, channels + slice.channel, slice.length);
+
+    if constexpr (Block + 1 < SUIDI_PACKET_BLOCKS)
+        suidiPackBlocks<Block + 1>(packet, channels, blocks);
+}
+
+/** Bitmap of the blocks whose channels differ between two universes.
+    Each block is compared in one go, which the compiler and libc do a
+    vector register at a time. */
+template <int Block = 0>
+inline uint suidiDirtyBlocks(const uchar *previous, const uchar *channels)
+{
+    constexpr SUIDIPacketSlice slice = suidiPacketSlice(Block);
+    uint dirty = 0;
+    if (memcmp(previous + slice.channel, channels + slice.channel, slice.length) != 0)
+        dirty = 1u << Block;
+
+    if constexpr (Block + 1 < SUIDI_PACKET_BLOCKS)
+        dirty |= suidiDirtyBlocks<Block + 1>(previous, channels);
+    return dirty;
+}
+
+#endif
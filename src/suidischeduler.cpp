@@ -0,0 +1,765 @@
+#include <libusb.h>
+
+#include <QDeadlineTimer>
+#include <QStringList>
+#include <QSettings>
+#include <QDebug>
+#include <chrono>
+#ifdef Q_OS_LINUX
+#include <sys/timerfd.h>
+#include <sys/eventfd.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sched.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+#endif
+
+#include "suidischeduler.h"
+#include "suididevice.h"
+#include "qlcmacros.h"
+
+#define NSECS_PER_MSEC 1000000LL
+#define NSECS_PER_SEC 1000000000LL
+#define NSECS_PER_USEC 1000LL
+
+/* Sleeps are measured over this long before the margin is sized anew */
+#define SUIDI_CALIBRATION_PERIOD NSECS_PER_SEC
+
+/* Opt-in real-time mode of the frame clock: "fifo" or "rr" policy, its
+   priority, a CPU to pin the thread to and whether to lock memory */
+#define SETTINGS_REALTIME_POLICY "suidi/realtime/policy"
+#define SETTINGS_REALTIME_PRIORITY "suidi/realtime/priority"
+#define SETTINGS_REALTIME_CPU "suidi/realtime/cpu"
+#define SETTINGS_REALTIME_MEMLOCK "suidi/realtime/memlock"
+
+/* Upper bound of the window deadlines are grouped in (us) */
+#define SETTINGS_GROUPING_WINDOW "suidi/wheel/window"
+
+/* Monotonic time in nanoseconds, on the clock the frame deadlines use */
+static qint64 clockNsecs()
+{
+#ifdef Q_OS_LINUX
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return qint64(ts.tv_sec) * NSECS_PER_SEC + ts.tv_nsec;
+#else
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+                std::chrono::steady_clock::now().time_since_epoch()).count();
+#endif
+}
+
+#ifdef Q_OS_LINUX
+/* Touch the stack the frame path may use, so no page of it faults in
+   while a frame is due */
+static void prefaultStack()
+{
+    volatile uchar stack[SUIDI_PREFAULT_STACK];
+    for (int i = 0; i < SUIDI_PREFAULT_STACK; i += 4096)
+        stack[i] = 0;
+    Q_UNUSED(stack)
+}
+#endif
+
+/****************************************************************************
+ * Event thread
+ ****************************************************************************/
+
+SUIDIEventThread::SUIDIEventThread(libusb_context *ctx, QObject *parent)
+    : QThread(parent)
+    , m_ctx(ctx)
+    , m_running(false)
+{
+}
+
+void SUIDIEventThread::stop()
+{
+    while (isRunning() == true)
+    {
+        m_running = false;
+        libusb_interrupt_event_handler(m_ctx);
+        wait(100);
+    }
+}
+
+void SUIDIEventThread::run()
+{
+    m_running = true;
+    while (m_running == true)
+    {
+        /* Sleeps until a transfer completes or stop() interrupts it */
+        int r = libusb_handle_events_completed(m_ctx, NULL);
+        if (r < 0 && r != LIBUSB_ERROR_INTERRUPTED)
+            qWarning() << "SUIDI: unable to handle USB events:" << libusb_strerror(libusb_error(r));
+    }
+}
+
+/****************************************************************************
+ * Recovery thread
+ ****************************************************************************/
+
+SUIDIRecoveryThread::SUIDIRecoveryThread(QObject *parent)
+    : QThread(parent)
+    , m_current(NULL)
+    , m_running(false)
+{
+}
+
+void SUIDIRecoveryThread::recover(SUIDIDevice *device)
+{
+    QMutexLocker locker(&m_mutex);
+    if (m_queue.contains(device) == true || m_current == device)
+        return;
+
+    m_queue.append(device);
+    m_changed.wakeAll();
+
+    if (m_running == false)
+    {
+        m_running = true;
+        start();
+    }
+}
+
+void SUIDIRecoveryThread::cancel(SUIDIDevice *device)
+{
+    QMutexLocker locker(&m_mutex);
+    m_queue.removeAll(device);
+    while (m_current == device)
+        m_changed.wait(&m_mutex);
+}
+
+void SUIDIRecoveryThread::stop()
+{
+    while (isRunning() == true)
+    {
+        m_mutex.lock();
+        m_running = false;
+        m_changed.wakeAll();
+        m_mutex.unlock();
+        wait(100);
+    }
+}
+
+void SUIDIRecoveryThread::run()
+{
+    m_mutex.lock();
+    while (m_running == true)
+    {
+        if (m_queue.isEmpty() == true)
+        {
+            m_changed.wait(&m_mutex);
+            continue;
+        }
+
+        m_current = m_queue.takeFirst();
+        m_mutex.unlock();
+        m_current->recoverEndpoints();
+        m_mutex.lock();
+        m_current = NULL;
+        m_changed.wakeAll();
+    }
+    m_mutex.unlock();
+}
+
+/****************************************************************************
+ * Initialization
+ ****************************************************************************/
+
+SUIDIScheduler::SUIDIScheduler(libusb_context *ctx, QObject *parent)
+    : QThread(parent)
+    , m_eventThread(new SUIDIEventThread(ctx, this))
+    , m_recoveryThread(new SUIDIRecoveryThread(this))
+    , m_running(false)
+    , m_epollFd(-1)
+    , m_timerFd(-1)
+    , m_eventFd(-1)
+    , m_wakeupStart(0)
+    , m_wakeups(0)
+    , m_wakeupRate(0)
+    , m_windowLimit(SUIDI_AUTO_GROUPING_WINDOW)
+    , m_groupingWindow(0)
+    , m_epoch(clockNsecs())
+    , m_lastSkew(0)
+    , m_maxSkew(0)
+    , m_calibrationStart(0)
+    , m_overshootSum(0)
+    , m_overshootPeak(0)
+    , m_sleeps(0)
+    , m_meanOvershoot(-1)
+    , m_maxOvershoot(-1)
+    , m_spinMargin(SUIDI_MAX_SPIN_MARGIN)
+{
+#ifdef Q_OS_LINUX
+    m_epollFd = epoll_create1(EPOLL_CLOEXEC);
+    m_timerFd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC | TFD_NONBLOCK);
+    m_eventFd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.fd = m_timerFd;
+    bool ok = m_epollFd >= 0 && m_timerFd >= 0 && m_eventFd >= 0 &&
+              epoll_ctl(m_epollFd, EPOLL_CTL_ADD, m_timerFd, &ev) == 0;
+    ev.data.fd = m_eventFd;
+    ok = ok && epoll_ctl(m_epollFd, EPOLL_CTL_ADD, m_eventFd, &ev) == 0;
+
+    /* Without them the frame clock sleeps like on other platforms */
+    if (ok == false)
+    {
+        qWarning() << "SUIDI: unable to set up the timing wheel:" << strerror(errno);
+        if (m_epollFd >= 0)
+            ::close(m_epollFd);
+        if (m_timerFd >= 0)
+            ::close(m_timerFd);
+        if (m_eventFd >= 0)
+            ::close(m_eventFd);
+        m_epollFd = m_timerFd = m_eventFd = -1;
+    }
+#endif
+}
+
+SUIDIScheduler::~SUIDIScheduler()
+{
+    stop();
+
+#ifdef Q_OS_LINUX
+    if (m_epollFd >= 0)
+    {
+        ::close(m_epollFd);
+        ::close(m_timerFd);
+        ::close(m_eventFd);
+    }
+#endif
+}
+
+/****************************************************************************
+ * Devices
+ ****************************************************************************/
+
+void SUIDIScheduler::addDevice(SUIDIDevice *device)
+{
+    m_mutex.lock();
+    for (int i = 0; i < m_devices.count(); i++)
+    {
+        if (m_devices.at(i).device == device)
+        {
+            m_mutex.unlock();
+            return;
+        }
+    }
+    /* The first frame waits for the next deadline of the frame grid,
+       so devices of the same rate send frame N together */
+    qint64 period = device->framePeriod();
+    m_devices.append(ScheduledDevice{ device, alignedDeadline(clockNsecs(), period),
+                                      period, 0, 0, 0 });
+    /* Set before the thread starts, so a stop() right after this
+       is never undone by run() */
+    m_running = true;
+    m_mutex.unlock();
+    wakeUp();
+
+    if (m_eventThread->isRunning() == false)
+        m_eventThread->start();
+    if (isRunning() == false)
+        start();
+}
+
+void SUIDIScheduler::removeDevice(SUIDIDevice *device)
+{
+    bool found = false;
+
+    m_mutex.lock();
+    for (int i = 0; i < m_devices.count(); i++)
+    {
+        if (m_devices.at(i).device == device)
+        {
+            m_devices.removeAt(i);
+            found = true;
+            break;
+        }
+    }
+    bool idle = m_devices.isEmpty();
+    m_mutex.unlock();
+
+    if (found == false)
+        return;
+
+    m_recoveryThread->cancel(device);
+
+    /* The event thread must keep running until the device's
+       transfers have completed or been cancelled */
+    device->cancelTransfers();
+    while (device->transfersInFlight() > 0)
+        QThread::msleep(1);
+
+    if (idle == true)
+        stop();
+}
+
+void SUIDIScheduler::wakeUp()
+{
+#ifdef Q_OS_LINUX
+    /* The event counts up until the frame clock polls it, so a wakeup
+       is never lost and the caller never blocks */
+    if (m_eventFd >= 0)
+    {
+        quint64 one = 1;
+        if (::write(m_eventFd, &one, sizeof(one)) < 0)
+            qWarning() << "SUIDI: unable to wake the frame clock:" << strerror(errno);
+        return;
+    }
+#endif
+
+    /* The flag keeps a wakeup for a clock that is not sleeping yet.
+       The mutex of the wait is never held across a tick, so the caller
+       does not wait for the frames being queued. */
+    m_woken.storeRelease(1);
+    m_wakeupMutex.lock();
+    m_wakeup.wakeAll();
+    m_wakeupMutex.unlock();
+}
+
+void SUIDIScheduler::recoverDevice(SUIDIDevice *device)
+{
+    m_recoveryThread->recover(device);
+}
+
+int SUIDIScheduler::skippedFrames(const SUIDIDevice *device)
+{
+    QMutexLocker locker(&m_mutex);
+    for (int i = 0; i < m_devices.count(); i++)
+        if (m_devices.at(i).device == device)
+            return m_devices.at(i).skipped;
+    return 0;
+}
+
+qint64 SUIDIScheduler::alignedDeadline(qint64 now, qint64 period) const
+{
+    return m_epoch + ((now - m_epoch) / period + 1) * period;
+}
+
+void SUIDIScheduler::advanceDevice(ScheduledDevice &sd, qint64 now)
+{
+    sd.servedFrame = sd.nextFrame;
+    sd.startedAt = clockNsecs();
+    sd.device->writeFrame();
+
+    /* Every frame is exactly one period after the previous one, so
+       overruns never add up to a drift. A new rate joins the grid of
+       its period again. */
+    qint64 period = sd.device->framePeriod();
+    if (period != sd.period)
+    {
+        sd.period = period;
+        sd.nextFrame = alignedDeadline(now, period);
+        return;
+    }
+    sd.nextFrame += period;
+
+    /* A little late, the next frames follow right away until the clock
+       is caught up. Far behind, the missed deadlines are given up
+       while staying in phase. */
+    qint64 late = now - sd.nextFrame;
+    if (late >= period * SUIDI_CATCH_UP_FRAMES)
+    {
+        qint64 missed = late / period + 1;
+        sd.nextFrame += missed * period;
+        sd.skipped += int(missed);
+    }
+}
+
+qint64 SUIDIScheduler::updateGroupingWindow(qint64 *shortest)
+{
+    qint64 fastest = m_devices.first().period;
+    bool shared = true;
+    for (int i = 1; i < m_devices.count(); i++)
+    {
+        fastest = qMin(fastest, m_devices.at(i).period);
+        if (m_devices.at(i).period != m_devices.first().period)
+            shared = false;
+    }
+
+    /* Devices of one rate meet on the frame grid anyway. With half the
+       fastest period on either side, any deadline of a slower device
+       lies within the window of one of the fastest device's wakeups. */
+    qint64 window = 0;
+    if (shared == false)
+    {
+        window = fastest / 2;
+        if (m_windowLimit >= 0)
+            window = qMin(window, m_windowLimit * NSECS_PER_USEC);
+    }
+
+    *shortest = fastest;
+    m_groupingWindow.storeRelaxed(int(window / NSECS_PER_USEC));
+    return window;
+}
+
+void SUIDIScheduler::measureSkew(qint64 tick)
+{
+    int skew = -1;
+    for (int i = 0; i < m_devices.count(); i++)
+    {
+        const ScheduledDevice &a = m_devices.at(i);
+        if (a.startedAt < tick)
+            continue;
+
+        for (int j = i + 1; j < m_devices.count(); j++)
+        {
+            const ScheduledDevice &b = m_devices.at(j);
+            if (b.startedAt >= tick && b.servedFrame == a.servedFrame)
+                skew = qMax(skew, int(qAbs(b.startedAt - a.startedAt) / NSECS_PER_USEC));
+        }
+    }
+
+    if (skew < 0)
+        return;
+
+    m_lastSkew.storeRelaxed(skew);
+    if (skew > m_maxSkew.loadRelaxed())
+        m_maxSkew.storeRelaxed(skew);
+}
+
+/****************************************************************************
+ * Thread
+ ****************************************************************************/
+
+bool SUIDIScheduler::isCalibrated() const
+{
+    return m_maxOvershoot.loadRelaxed() >= 0;
+}
+
+int SUIDIScheduler::meanOvershoot() const
+{
+    return m_meanOvershoot.loadRelaxed();
+}
+
+int SUIDIScheduler::maxOvershoot() const
+{
+    return m_maxOvershoot.loadRelaxed();
+}
+
+int SUIDIScheduler::spinMargin() const
+{
+    return m_spinMargin.loadRelaxed();
+}
+
+int SUIDIScheduler::wakeupRate() const
+{
+    return m_wakeupRate.loadRelaxed();
+}
+
+int SUIDIScheduler::groupingWindow() const
+{
+    return m_groupingWindow.loadRelaxed();
+}
+
+int SUIDIScheduler::lastSkew() const
+{
+    return m_lastSkew.loadRelaxed();
+}
+
+int SUIDIScheduler::maxSkew() const
+{
+    return m_maxSkew.loadRelaxed();
+}
+
+QString SUIDIScheduler::realtimeMode()
+{
+    QMutexLocker locker(&m_mutex);
+    if (m_realtimeMode.isEmpty())
+        return tr("Not running");
+    return m_realtimeMode;
+}
+
+void SUIDIScheduler::stop()
+{
+    while (isRunning() == true)
+    {
+        m_mutex.lock();
+        m_running = false;
+        m_mutex.unlock();
+        wakeUp();
+        wait(100);
+    }
+
+    m_recoveryThread->stop();
+    m_eventThread->stop();
+}
+
+void SUIDIScheduler::run()
+{
+    QString mode = applyRealtime();
+    m_windowLimit = QSettings().value(SETTINGS_GROUPING_WINDOW, SUIDI_AUTO_GROUPING_WINDOW).toInt();
+    m_calibrationStart = clockNsecs();
+    m_wakeupStart = m_calibrationStart;
+
+    m_mutex.lock();
+    m_realtimeMode = mode;
+    while (m_running == true)
+    {
+        /* Nothing to refresh, wait for a device or stop() */
+        if (m_devices.isEmpty() == true)
+        {
+            waitUntil(-1, true);
+            continue;
+        }
+
+        qint64 now = clockNsecs();
+        qint64 nextFrame = now + NSECS_PER_SEC;
+        bool interruptible = false;
+        countWakeup(now);
+
+        /* The fastest devices wake the clock right at their deadlines.
+           Slower ones due within the grouping window get their frames
+           queued along, so devices of different rates share wakeups,
+           and only wake it themselves once the window has passed, so
+           none of their frames goes out more than the window early or
+           late. Changed universes go out right away, outside of the
+           frame deadlines. */
+        qint64 shortest = 0;
+        qint64 window = updateGroupingWindow(&shortest);
+        for (int i = 0; i < m_devices.count(); i++)
+        {
+            ScheduledDevice &sd = m_devices[i];
+            qint64 slack = (sd.period == shortest) ? 0 : window;
+            if (sd.nextFrame <= now + slack)
+                advanceDevice(sd, now);
+            else if (sd.device->hasChanges() == true)
+                sd.device->writeFrame(false);
+            if (sd.nextFrame + slack < nextFrame)
+                nextFrame = sd.nextFrame + slack;
+            if (sd.device->sendsOnChange() == true)
+                interruptible = true;
+        }
+
+        if (m_devices.count() > 1)
+            measureSkew(now);
+
+        sleepUntil(nextFrame, interruptible);
+    }
+    m_mutex.unlock();
+}
+
+QString SUIDIScheduler::applyRealtime()
+{
+    QSettings settings;
+    QString policy = settings.value(SETTINGS_REALTIME_POLICY).toString();
+    int priority = settings.value(SETTINGS_REALTIME_PRIORITY, SUIDI_DEFAULT_REALTIME_PRIORITY).toInt();
+    int cpu = settings.value(SETTINGS_REALTIME_CPU, -1).toInt();
+    bool memlock = settings.value(SETTINGS_REALTIME_MEMLOCK, false).toBool();
+    bool realtime = (policy == "fifo" || policy == "rr");
+    QStringList applied;
+
+#ifdef Q_OS_LINUX
+    if (realtime == true)
+    {
+        int sched = (policy == "fifo") ? SCHED_FIFO : SCHED_RR;
+        struct sched_param param;
+        param.sched_priority = CLAMP(priority, sched_get_priority_min(sched),
+                                     sched_get_priority_max(sched));
+        int r = pthread_setschedparam(pthread_self(), sched, &param);
+        if (r == 0)
+        {
+            applied << QString("%1 %2").arg(sched == SCHED_FIFO ? "SCHED_FIFO" : "SCHED_RR")
+                                       .arg(param.sched_priority);
+        }
+        else
+        {
+            /* Without CAP_SYS_NICE or an rtprio limit this is as close
+               as an unprivileged thread gets */
+            qWarning() << "SUIDI: unable to schedule the frame clock as" << policy
+                       << "priority" << param.sched_priority << ":" << strerror(r);
+            setPriority(TimeCriticalPriority);
+            applied << tr("time critical priority");
+        }
+    }
+
+    if (cpu >= 0)
+    {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(cpu, &set);
+        int r = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+        if (r == 0)
+            applied << tr("pinned to CPU %1").arg(cpu);
+        else
+            qWarning() << "SUIDI: unable to pin the frame clock to CPU" << cpu << ":" << strerror(r);
+    }
+
+    /* Locks the pages the whole process has mapped by now, including
+       the frame clock's stack. Later allocations are left unlocked, so
+       QLC+ never runs into the memlock limit while growing. */
+    if (memlock == true)
+    {
+        prefaultStack();
+        if (mlockall(MCL_CURRENT) == 0)
+        {
+            applied << tr("current memory of the whole process locked");
+        }
+        else
+        {
+            qWarning() << "SUIDI: unable to lock memory:" << strerror(errno);
+        }
+    }
+#else
+    Q_UNUSED(priority)
+    Q_UNUSED(memlock)
+    if (cpu >= 0)
+        qWarning() << "SUIDI: CPU affinity is not supported on this platform";
+
+    if (realtime == true)
+    {
+        setPriority(TimeCriticalPriority);
+        applied << tr("time critical priority");
+    }
+#endif
+
+    if (applied.isEmpty())
+        return tr("Normal priority");
+    return applied.join(", ");
+}
+
+void SUIDIScheduler::sleepUntil(qint64 deadline, bool interruptible)
+{
+    /* Wake up early by the margin the sleeps are known to overshoot */
+    qint64 wakeup = deadline - m_spinMargin.loadRelaxed() * NSECS_PER_USEC;
+
+    qint64 now = clockNsecs();
+    if (wakeup > now)
+    {
+        if (waitUntil(wakeup, interruptible) == true)
+            return;
+        now = clockNsecs();
+        calibrate(now - wakeup);
+    }
+
+    m_mutex.unlock();
+    while (now < deadline)
+        now = clockNsecs(); /* Busy sleep */
+    m_mutex.lock();
+}
+
+bool SUIDIScheduler::waitUntil(qint64 wakeup, bool interruptible)
+{
+#ifdef Q_OS_LINUX
+    if (m_epollFd >= 0)
+    {
+        /* One absolute timer for the earliest deadline of every device,
+           wakeUp() always cuts it short */
+        struct itimerspec its;
+        memset(&its, 0, sizeof(its));
+        if (wakeup >= 0)
+        {
+            its.it_value.tv_sec = wakeup / NSECS_PER_SEC;
+            its.it_value.tv_nsec = wakeup % NSECS_PER_SEC;
+        }
+        timerfd_settime(m_timerFd, TFD_TIMER_ABSTIME, &its, NULL);
+
+        m_mutex.unlock();
+        bool woken = false;
+        bool expired = false;
+        while (woken == false && expired == false)
+        {
+            struct epoll_event events[2];
+            int count = epoll_wait(m_epollFd, events, 2, -1);
+            for (int i = 0; i < count; i++)
+            {
+                quint64 expirations;
+                if (::read(events[i].data.fd, &expirations, sizeof(expirations)) < 0)
+                    continue;
+                if (events[i].data.fd == m_eventFd)
+                    woken = true;
+            }
+
+            /* A stale expiry from an earlier deadline does not count */
+            expired = wakeup >= 0 && clockNsecs() >= wakeup;
+        }
+        m_mutex.lock();
+
+        return woken;
+    }
+#endif
+
+    qint64 now = clockNsecs();
+    if (wakeup < 0 || interruptible == true)
+    {
+        /* Changed universes must not wait for the deadline */
+        QDeadlineTimer timer(Qt::PreciseTimer);
+        if (wakeup >= 0)
+            timer.setPreciseRemainingTime(0, wakeup - now, Qt::PreciseTimer);
+        else
+            timer = QDeadlineTimer(QDeadlineTimer::Forever);
+
+        m_mutex.unlock();
+        m_wakeupMutex.lock();
+        bool woken = m_woken.fetchAndStoreAcquire(0) != 0;
+        while (woken == false && timer.hasExpired() == false)
+        {
+            m_wakeup.wait(&m_wakeupMutex, timer);
+            woken = m_woken.fetchAndStoreAcquire(0) != 0;
+        }
+        m_wakeupMutex.unlock();
+        m_mutex.lock();
+
+        return woken;
+    }
+
+    m_mutex.unlock();
+#ifdef Q_OS_LINUX
+    /* Absolute deadlines do not stretch by the time spent getting here */
+    struct timespec ts;
+    ts.tv_sec = wakeup / NSECS_PER_SEC;
+    ts.tv_nsec = wakeup % NSECS_PER_SEC;
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR) { }
+#else
+    usleep(static_cast<unsigned long>((wakeup - now) / NSECS_PER_USEC));
+#endif
+    m_mutex.lock();
+
+    return false;
+}
+
+void SUIDIScheduler::countWakeup(qint64 now)
+{
+    m_wakeups++;
+    if (now - m_wakeupStart < NSECS_PER_SEC)
+        return;
+
+    m_wakeupRate.storeRelaxed(int(m_wakeups * NSECS_PER_SEC / qMax(now - m_wakeupStart, NSECS_PER_SEC)));
+    m_wakeupStart = now;
+    m_wakeups = 0;
+}
+
+void SUIDIScheduler::calibrate(qint64 overshoot)
+{
+    m_overshootSum += overshoot;
+    if (overshoot > m_overshootPeak)
+        m_overshootPeak = overshoot;
+    m_sleeps++;
+
+    /* A sleep later than the margin widens it at once, so one slow
+       wakeup does not cost a whole period of missed deadlines */
+    int margin = m_spinMargin.loadRelaxed();
+    if (overshoot / NSECS_PER_USEC > margin)
+        m_spinMargin.storeRelaxed(qMin(int(overshoot / NSECS_PER_USEC), SUIDI_MAX_SPIN_MARGIN));
+
+    qint64 now = clockNsecs();
+    if (now - m_calibrationStart < SUIDI_CALIBRATION_PERIOD)
+        return;
+
+    /* Spin a quarter more than the worst sleep of the period, a quiet
+       period lets the margin shrink again */
+    m_meanOvershoot.storeRelaxed(int(m_overshootSum / m_sleeps / NSECS_PER_USEC));
+    m_maxOvershoot.storeRelaxed(int(m_overshootPeak / NSECS_PER_USEC));
+    margin = int(m_overshootPeak * 5 / 4 / NSECS_PER_USEC);
+    m_spinMargin.storeRelaxed(qBound(SUIDI_MIN_SPIN_MARGIN, margin, SUIDI_MAX_SPIN_MARGIN));
+
+    m_calibrationStart = now;
+    m_overshootSum = 0;
+    m_overshootPeak = 0;
+    m_sleeps = 0;
+}
@@ -0,0 +1,249 @@
+#ifndef SUIDISCHEDULER_H
+#define SUIDISCHEDULER_H
+
+#include <QWaitCondition>
+#include <QAtomicInt>
+#include <QThread>
+#include <QMutex>
+#include <QList>
+
+/* Frames a late device may send back to back to get back on its
+   deadlines, anything later is skipped */
+#define SUIDI_CATCH_UP_FRAMES 2
+
+/* Stack touched up front when the frame clock locks its memory */
+#define SUIDI_PREFAULT_STACK (64 * 1024)
+#define SUIDI_DEFAULT_REALTIME_PRIORITY 50
+
+/* Slower devices whose deadlines lie within this window of a wakeup
+   of the fastest device are served by it, at most this early or late
+   (us). By default half the shortest period, so that slower devices
+   always ride on the wakeups of the fastest one. */
+#define SUIDI_AUTO_GROUPING_WINDOW -1
+
+/* Bounds of the time spun before a deadline instead of sleeping (us) */
+#define SUIDI_MIN_SPIN_MARGIN 50
+#define SUIDI_MAX_SPIN_MARGIN 2000
+
+struct libusb_context;
+class SUIDIDevice;
+
+/** Thread dispatching the completions of every SUIDI transfer */
+class SUIDIEventThread : public QThread
+{
+    Q_OBJECT
+
+public:
+    SUIDIEventThread(libusb_context *ctx, QObject *parent = 0);
+
+    /** Stop handling events and wait for the thread to finish */
+    void stop();
+
+private:
+    /** libusb event loop worker method */
+    void run();
+
+private:
+    struct libusb_context *m_ctx;
+    bool m_running;
+};
+
+/** Thread taking devices through stall recovery, so clearing a halt
+    or resetting a device never holds up the frame clock */
+class SUIDIRecoveryThread : public QThread
+{
+    Q_OBJECT
+
+public:
+    SUIDIRecoveryThread(QObject *parent = 0);
+
+    /** Queue the given device for recovery, unless it is queued already */
+    void recover(SUIDIDevice *device);
+
+    /** Forget the given device and wait until it is no longer being
+        recovered */
+    void cancel(SUIDIDevice *device);
+
+    /** Stop recovering and wait for the thread to finish */
+    void stop();
+
+private:
+    /** Recovery worker method */
+    void run();
+
+private:
+    QMutex m_mutex;
+    QWaitCondition m_changed;
+    QList <SUIDIDevice*> m_queue;
+    SUIDIDevice *m_current;
+    bool m_running;
+};
+
+typedef struct {
+    SUIDIDevice *device;
+    /** Absolute deadline of the next frame on the monotonic clock (ns) */
+    qint64 nextFrame;
+    /** Period the deadlines are currently spaced at (ns) */
+    qint64 period;
+    /** Frame deadlines given up after falling too far behind */
+    int skipped;
+    /** Deadline served by the last frame and when it was started (ns) */
+    qint64 servedFrame;
+    qint64 startedAt;
+
+} ScheduledDevice;
+
+/** Plugin-wide frame clock driving all open SUIDI devices */
+class SUIDIScheduler : public QThread
+{
+    Q_OBJECT
+
+    /********************************************************************
+     * Initialization
+     ********************************************************************/
+public:
+    SUIDIScheduler(libusb_context *ctx, QObject *parent = 0);
+    virtual ~SUIDIScheduler();
+
+    /********************************************************************
+     * Devices
+     ********************************************************************/
+public:
+    /** Start refreshing the given device at its own frame rate */
+    void addDevice(SUIDIDevice *device);
+
+    /** Stop refreshing the given device and wait until all of its
+        transfers have left the bus */
+    void removeDevice(SUIDIDevice *device);
+
+    /** Cut the sleep short for a device with changed universes */
+    void wakeUp();
+
+    /** Run stall recovery of the given device off the frame clock */
+    void recoverDevice(SUIDIDevice *device);
+
+    /** Frame deadlines the given device missed by more than the catch
+        up allows */
+    int skippedFrames(const SUIDIDevice *device);
+
+private:
+    /** Send the frame of a due device and move on to its next deadline */
+    void advanceDevice(ScheduledDevice &sd, qint64 now);
+
+    /** First deadline after the given time on the plugin-wide frame
+        grid of the given period */
+    qint64 alignedDeadline(qint64 now, qint64 period) const;
+
+    /** Measure how far apart the devices started that served the same
+        deadline during the last tick */
+    void measureSkew(qint64 tick);
+
+    /** Window deadlines are grouped in for the current devices (ns),
+        none while they all share one period. Sets shortest to the
+        period of the fastest devices. */
+    qint64 updateGroupingWindow(qint64 *shortest);
+
+private:
+    QList <ScheduledDevice> m_devices;
+
+    /********************************************************************
+     * Thread
+     ********************************************************************/
+public:
+    /** Whether the sleep overshoot has been measured yet */
+    bool isCalibrated() const;
+
+    /** Mean and worst time the last calibration period's sleeps woke up
+        after they were due (us) */
+    int meanOvershoot() const;
+    int maxOvershoot() const;
+
+    /** Time spun before each deadline to absorb the overshoot (us) */
+    int spinMargin() const;
+
+    /** Scheduling the frame clock actually runs with */
+    QString realtimeMode();
+
+    /** Times per second the frame clock woke up, over the last second */
+    int wakeupRate() const;
+
+    /** Window around a wakeup that deadlines of slower devices are
+        served in, which is how early or late their frames may go out
+        at most (us). The fastest devices keep their deadlines. */
+    int groupingWindow() const;
+
+    /** Time between the first and the last device starting the same
+        frame, for the last shared frame and the worst so far (us) */
+    int lastSkew() const;
+    int maxSkew() const;
+
+private:
+    /** Stop the frame clock and the event thread */
+    void stop();
+
+    /** Frame clock worker method */
+    void run();
+
+    /** Apply the opt-in real-time settings to the frame clock thread,
+        falling back step by step where privileges are missing.
+        Returns a description of what was applied. */
+    QString applyRealtime();
+
+    /** Sleep most of the way to the given absolute deadline (ns) and
+        spin for the rest, returns with the mutex locked again. An
+        interruptible sleep returns early on wakeUp(). */
+    void sleepUntil(qint64 deadline, bool interruptible);
+
+    /** Block until the given absolute time (ns), or until wakeUp() if
+        negative. Returns true when wakeUp() ended the wait. */
+    bool waitUntil(qint64 wakeup, bool interruptible);
+
+    /** Count a wakeup of the frame clock towards the wakeup rate */
+    void countWakeup(qint64 now);
+
+    /** Account for a sleep that woke up the given time too late (ns),
+        and size the spin margin anew once per calibration period */
+    void calibrate(qint64 overshoot);
+
+private:
+    SUIDIEventThread *m_eventThread;
+    SUIDIRecoveryThread *m_recoveryThread;
+    QMutex m_mutex;
+    /** Wakeups where the platform has no event to poll, signalled
+        without taking the mutex the frame clock ticks under */
+    QAtomicInt m_woken;
+    QMutex m_wakeupMutex;
+    QWaitCondition m_wakeup;
+    bool m_running;
+    QString m_realtimeMode;
+
+    /* Timing wheel of all deadlines, a timer and a wakeup event polled
+       together where the platform has them */
+    int m_epollFd;
+    int m_timerFd;
+    int m_eventFd;
+    qint64 m_wakeupStart;
+    int m_wakeups;
+    QAtomicInt m_wakeupRate;
+    /** Configured upper bound of the grouping window (us), negative
+        for half the shortest period */
+    int m_windowLimit;
+    QAtomicInt m_groupingWindow;
+
+    /** Start of the frame grid shared by all devices (ns) */
+    qint64 m_epoch;
+    QAtomicInt m_lastSkew;
+    QAtomicInt m_maxSkew;
+
+    /* Calibration of the sleep, only touched by the frame clock */
+    qint64 m_calibrationStart;
+    qint64 m_overshootSum;
+    qint64 m_overshootPeak;
+    int m_sleeps;
+
+    QAtomicInt m_meanOvershoot;
+    QAtomicInt m_maxOvershoot;
+    QAtomicInt m_spinMargin;
+};
+
+#endif
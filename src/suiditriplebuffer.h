@@ -0,0 +1,118 @@
+#ifndef SUIDITRIPLEBUFFER_H
+#define SUIDITRIPLEBUFFER_H
+
+#include <QAtomicInt>
+
+/**
+ * Lock-free handoff of one universe between the thread packing it and
+ * the thread sending it, with "latest wins" semantics.
+ *
+ * The class only deals in buffer indices, the owner maps them to memory.
+ * The producer always packs into its own back buffer and publishes it
+ * by swapping it with the shared ready slot. The consumer takes the
+ * ready buffer as its new front when it is fresh, giving back one of its
+ * own buffers that no transfer is sending. Neither side ever waits for
+ * the other and the front buffer always holds a complete packet.
+ *
+ * Classic triple buffering keeps one buffer on each side. Here the
+ * consumer may have several transfers on the bus at once, so it needs
+ * one extra buffer per additional transfer in flight.
+ */
+template <int Buffers>
+class SUIDITripleBuffer
+{
+public:
+    SUIDITripleBuffer()
+        : m_back(0)
+        , m_ready(1)
+        , m_front(2)
+    {
+        for (int i = 0; i < Buffers; i++)
+        {
+            m_owned[i] = (i >= 2);
+            m_sending[i].storeRelaxed(0);
+        }
+    }
+
+    /********************************************************************
+     * Producer
+     ********************************************************************/
+public:
+    /** Index of the buffer to pack the next frame into */
+    int back() const
+    {
+        return m_back;
+    }
+
+    /** Make the packed back buffer the latest frame. An older frame the
+        consumer has not picked up yet becomes the new back buffer. */
+    void publish()
+    {
+        m_back = m_ready.fetchAndStoreAcqRel(m_back | Fresh) & IndexMask;
+    }
+
+    /********************************************************************
+     * Consumer
+     ********************************************************************/
+public:
+    /** Index of the latest complete frame. Sets fresh, if given, to
+        whether a frame the consumer had not seen yet was picked up. */
+    int front(bool *fresh = NULL)
+    {
+        if (fresh != NULL)
+            *fresh = false;
+
+        if ((m_ready.loadAcquire() & Fresh) == 0)
+            return m_front;
+
+        int idle = idleBuffer();
+        if (idle < 0)
+            return m_front;
+
+        m_owned[idle] = false;
+        m_front = m_ready.fetchAndStoreAcqRel(idle) & IndexMask;
+        m_owned[m_front] = true;
+
+        if (fresh != NULL)
+            *fresh = true;
+        return m_front;
+    }
+
+    /** Transfers currently sending the given buffer. Any thread may
+        release a reference once its transfer has completed. */
+    QAtomicInt *sending(int index)
+    {
+        return &m_sending[index];
+    }
+
+private:
+    /** One of the consumer's buffers that no transfer is sending */
+    int idleBuffer() const
+    {
+        for (int i = 0; i < Buffers; i++)
+            if (m_owned[i] == true && i != m_front && m_sending[i].loadAcquire() == 0)
+                return i;
+
+        if (m_sending[m_front].loadAcquire() == 0)
+            return m_front;
+
+        return -1;
+    }
+
+private:
+    enum { Fresh = 0x100, IndexMask = 0xff };
+
+    /** Producer only */
+    int m_back;
+
+    /** Shared, index of the ready buffer with the Fresh flag */
+    QAtomicInt m_ready;
+
+    /** Consumer only */
+    int m_front;
+    bool m_owned[Buffers];
+
+    QAtomicInt m_sending[Buffers];
+};
+
+#endif